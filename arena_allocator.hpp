@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+
+namespace fefu
+{
+    /**
+     *  Monotonic memory for short-lived containers.
+     *
+     *  Allocations are carved out of large blocks by bumping a pointer and
+     *  are never freed one by one: every block goes back to the system at
+     *  once when the arena is released or destroyed. Each new block is twice
+     *  the size of the previous one. An allocation too large for the next
+     *  block gets a block of its own size instead, which neither replaces
+     *  the block being carved nor changes the size of the next one. An arena
+     *  is not thread-safe; give every request or thread its own.
+     */
+    class arena
+    {
+    public:
+        /// Creates an arena whose first block holds about @a block_size bytes.
+        explicit arena(std::size_t block_size = 4096) noexcept :
+                _nextSize(block_size > minBlockSize ? block_size : minBlockSize) {}
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        ~arena() {
+            release();
+        }
+
+        /// Returns @a bytes bytes aligned to @a alignment, a power of two.
+        void* allocate(std::size_t bytes, std::size_t alignment) {
+            std::uintptr_t p = align(reinterpret_cast<std::uintptr_t>(_cur), alignment);
+            if (!_cur || bytes > static_cast<std::size_t>(_end - _cur) ||
+                p + bytes > reinterpret_cast<std::uintptr_t>(_end)) {
+                if (bytes + alignment > _nextSize - sizeof(block)) {
+                    block* own = newBlock(sizeof(block) + bytes + alignment);
+                    _used += bytes;
+                    return reinterpret_cast<void*>(align(reinterpret_cast<std::uintptr_t>(own + 1), alignment));
+                }
+                block* b = newBlock(_nextSize);
+                _cur = reinterpret_cast<char*>(b + 1);
+                _end = reinterpret_cast<char*>(b) + _nextSize;
+                _nextSize *= 2;
+                p = align(reinterpret_cast<std::uintptr_t>(_cur), alignment);
+            }
+            _cur = reinterpret_cast<char*>(p + bytes);
+            _used += bytes;
+            return reinterpret_cast<void*>(p);
+        }
+
+        /// Frees every block. Whatever was allocated from the arena is gone.
+        void release() noexcept {
+            while (_blocks) {
+                block* next = _blocks->next;
+                ::operator delete(_blocks);
+                _blocks = next;
+            }
+            _cur = _end = nullptr;
+            _used = 0;
+            _reserved = 0;
+        }
+
+        /// Bytes handed out since construction or the last release().
+        std::size_t used() const noexcept {
+            return _used;
+        }
+
+        /// Bytes taken from the system for blocks.
+        std::size_t reserved() const noexcept {
+            return _reserved;
+        }
+
+    private:
+        struct alignas(std::max_align_t) block {
+            block* next;
+        };
+
+        static constexpr std::size_t minBlockSize = 256;
+
+        block* _blocks = nullptr;
+        char* _cur = nullptr;
+        char* _end = nullptr;
+        std::size_t _nextSize;
+        std::size_t _used = 0;
+        std::size_t _reserved = 0;
+
+        static std::uintptr_t align(std::uintptr_t p, std::size_t alignment) noexcept {
+            return (p + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+        }
+
+        // Takes a block of size bytes from the system and links it in.
+        block* newBlock(std::size_t size) {
+            auto* b = static_cast<block*>(::operator new(size));
+            b->next = _blocks;
+            _blocks = b;
+            _reserved += size;
+            return b;
+        }
+    };
+
+    /**
+     *  Allocator that takes its memory from an arena; deallocate() does
+     *  nothing. Maps that use it allocate their slots, control bytes and
+     *  stored hashes from the arena, and growing one leaves its old arrays
+     *  there until the arena is released.
+     *
+     *  The arena must outlive every container using it.
+     */
+    template<typename T>
+    class arena_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using value_type = T;
+
+        explicit arena_allocator(arena& a) noexcept : _arena(&a) {}
+
+        template <class U>
+        arena_allocator(const arena_allocator<U>& other) noexcept : _arena(&other.resource()) {}
+
+        pointer allocate(size_type n) {
+            if (n > std::numeric_limits<size_type>::max() / sizeof(value_type)) throw std::bad_array_new_length();
+            return static_cast<pointer>(_arena->allocate(n * sizeof(value_type), alignof(value_type)));
+        }
+
+        void deallocate(pointer, size_type) noexcept {}
+
+        /// The arena memory comes from.
+        arena& resource() const noexcept {
+            return *_arena;
+        }
+
+    private:
+        arena* _arena;
+    };
+
+    template<typename T, typename U>
+    bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+        return &a.resource() == &b.resource();
+    }
+
+    template<typename T, typename U>
+    bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+        return !(a == b);
+    }
+
+}
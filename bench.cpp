@@ -0,0 +1,201 @@
+// Microbenchmarks of fefu::hash_map against std::unordered_map.
+//
+//     hash_map_bench [max_size]
+//
+// Sizes go from 1K up to max_size (default 1M, at most 100M) in steps of
+// ten. Every operation is repeated until it has run at least minOps times,
+// so small sizes are not dominated by timer resolution.
+
+#include "hash_map.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    // Bytes currently allocated through the global operator new.
+    std::size_t liveBytes = 0;
+
+    volatile std::uint64_t sink;
+
+    const std::size_t minOps = 2000000;
+
+    std::uint64_t mix64(std::uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    }
+
+    std::uint32_t mix32(std::uint32_t k) {
+        k ^= k >> 16;
+        k *= 0x85ebca6bu;
+        k ^= k >> 13;
+        k *= 0xc2b2ae35u;
+        k ^= k >> 16;
+        return k;
+    }
+
+    // The mixers are bijective, so keys [0, n) and [n, 2n) never collide.
+    template<typename Key>
+    Key makeKey(std::uint64_t i);
+
+    template<>
+    std::uint32_t makeKey<std::uint32_t>(std::uint64_t i) {
+        return mix32(static_cast<std::uint32_t>(i));
+    }
+
+    template<>
+    std::uint64_t makeKey<std::uint64_t>(std::uint64_t i) {
+        return mix64(i);
+    }
+
+    template<>
+    std::string makeKey<std::string>(std::uint64_t i) {
+        return "key:" + std::to_string(mix64(i));
+    }
+
+    using clock_type = std::chrono::steady_clock;
+
+    double nsSince(clock_type::time_point start) {
+        return std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+    }
+
+    struct result {
+        double insert = 0;
+        double hit = 0;
+        double miss = 0;
+        double erase = 0;
+        double iterate = 0;
+        double rehash = 0;
+        double copy = 0;
+        double bytes = 0;
+    };
+
+    template<typename Map, typename Key>
+    result run(const std::vector<Key>& hits, const std::vector<Key>& misses) {
+        result r;
+        const std::size_t n = hits.size();
+        const std::size_t reps = n >= minOps ? 1 : minOps / n;
+        const double ops = static_cast<double>(n) * reps;
+
+        for (std::size_t rep = 0; rep < reps; rep++) {
+            Map m;
+            auto start = clock_type::now();
+            for (std::size_t i = 0; i < n; i++) m.insert({hits[i], i});
+            r.insert += nsSince(start);
+        }
+        r.insert /= ops;
+
+        std::size_t before = liveBytes;
+        Map m;
+        for (std::size_t i = 0; i < n; i++) m.insert({hits[i], i});
+        r.bytes = static_cast<double>(liveBytes - before) / n;
+
+        std::uint64_t sum = 0;
+        auto start = clock_type::now();
+        for (std::size_t rep = 0; rep < reps; rep++)
+            for (const auto& k : hits) sum += m.find(k)->second;
+        r.hit = nsSince(start) / ops;
+
+        start = clock_type::now();
+        for (std::size_t rep = 0; rep < reps; rep++)
+            for (const auto& k : misses) sum += m.find(k) == m.end();
+        r.miss = nsSince(start) / ops;
+
+        start = clock_type::now();
+        for (std::size_t rep = 0; rep < reps; rep++)
+            for (const auto& x : m) sum += x.second;
+        r.iterate = nsSince(start) / ops;
+
+        for (std::size_t rep = 0; rep < reps; rep++) {
+            start = clock_type::now();
+            Map c(m);
+            r.copy += nsSince(start);
+            sum += c.size();
+
+            start = clock_type::now();
+            c.rehash(c.bucket_count() * 2);
+            r.rehash += nsSince(start);
+
+            start = clock_type::now();
+            for (const auto& k : hits) sum += c.erase(k);
+            r.erase += nsSince(start);
+        }
+        r.copy /= ops;
+        r.rehash /= ops;
+        r.erase /= ops;
+
+        sink = sum;
+        return r;
+    }
+
+    void row(const char* op, double ours, double theirs) {
+        std::printf("  %-12s %12.2f %12.2f %8.2fx\n", op, ours, theirs, theirs / ours);
+    }
+
+    template<typename Key>
+    void bench(const char* name, std::size_t maxSize) {
+        for (std::size_t n = 1000; n <= maxSize; n *= 10) {
+            std::vector<Key> hits, misses;
+            hits.reserve(n);
+            misses.reserve(n);
+            for (std::size_t i = 0; i < n; i++) {
+                hits.push_back(makeKey<Key>(i));
+                misses.push_back(makeKey<Key>(n + i));
+            }
+
+            result ours = run<fefu::hash_map<Key, std::uint64_t>>(hits, misses);
+            result theirs = run<std::unordered_map<Key, std::uint64_t>>(hits, misses);
+
+            std::printf("%s, %zu elements\n", name, n);
+            std::printf("  %-12s %12s %12s %9s\n", "ns/op", "hash_map", "unordered", "speedup");
+            row("insert", ours.insert, theirs.insert);
+            row("find hit", ours.hit, theirs.hit);
+            row("find miss", ours.miss, theirs.miss);
+            row("erase", ours.erase, theirs.erase);
+            row("iterate", ours.iterate, theirs.iterate);
+            row("rehash", ours.rehash, theirs.rehash);
+            row("copy", ours.copy, theirs.copy);
+            std::printf("  %-12s %12.1f %12.1f\n\n", "bytes/elem", ours.bytes, theirs.bytes);
+        }
+    }
+}
+
+// Tracks live heap bytes for the bytes/element figures.
+void* operator new(std::size_t n) {
+    void* p = std::malloc(n + sizeof(std::max_align_t));
+    if (!p) throw std::bad_alloc();
+    *static_cast<std::size_t*>(p) = n;
+    liveBytes += n;
+    return static_cast<char*>(p) + sizeof(std::max_align_t);
+}
+
+void operator delete(void* p) noexcept {
+    if (!p) return;
+    p = static_cast<char*>(p) - sizeof(std::max_align_t);
+    liveBytes -= *static_cast<std::size_t*>(p);
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    operator delete(p);
+}
+
+int main(int argc, char** argv) {
+    std::size_t maxSize = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    if (maxSize > 100000000) maxSize = 100000000;
+
+    bench<std::uint32_t>("32-bit keys", maxSize);
+    bench<std::uint64_t>("64-bit keys", maxSize);
+    bench<std::string>("string keys", maxSize);
+    return 0;
+}
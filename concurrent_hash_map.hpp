@@ -0,0 +1,630 @@
+#pragma once
+
+#include "hash_map.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <vector>
+
+namespace fefu
+{
+    /**
+     *  Fixed number of shards laid out on their own cache lines.
+     *
+     *  The count is rounded up to a power of two and a shard is picked from
+     *  the bits of a mixed hash just below the 7 a %hash_map uses as
+     *  fingerprints, so keys of one shard still spread over its table.
+     */
+    template<typename S>
+    class shard_array
+    {
+    public:
+        template<typename... Args>
+        explicit shard_array(std::size_t count, const Args&... args) :
+                _count(power_of_two_policy::capacity(count)) {
+            int bits = 0;
+            while ((std::size_t(1) << bits) < _count) bits++;
+            _shift = std::numeric_limits<std::size_t>::digits - 7 - bits;
+
+            _memory = ::operator new(_count * sizeof(S) + cache_line_size);
+            std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(_memory) + cache_line_size - 1)
+                                     & ~std::uintptr_t(cache_line_size - 1);
+            _shards = reinterpret_cast<S*>(aligned);
+
+            std::size_t built = 0;
+            try {
+                for (; built < _count; built++) new(_shards + built) S(args...);
+            } catch (...) {
+                destroy(built);
+                throw;
+            }
+        }
+
+        shard_array(const shard_array&) = delete;
+        shard_array& operator=(const shard_array&) = delete;
+
+        ~shard_array() {
+            destroy(_count);
+        }
+
+        std::size_t size() const noexcept {
+            return _count;
+        }
+
+        S& operator[](std::size_t i) noexcept {
+            return _shards[i];
+        }
+
+        const S& operator[](std::size_t i) const noexcept {
+            return _shards[i];
+        }
+
+        /// Returns the shard of a key given its unmixed hash.
+        S& forHash(std::size_t hash) noexcept {
+            return _shards[index(hash)];
+        }
+
+        const S& forHash(std::size_t hash) const noexcept {
+            return _shards[index(hash)];
+        }
+
+    private:
+        void* _memory = nullptr;
+        S* _shards = nullptr;
+        std::size_t _count = 0;
+        int _shift = 0;
+
+        std::size_t index(std::size_t hash) const noexcept {
+            if (_count == 1) return 0;
+            return (power_of_two_policy::mix(hash) >> _shift) & (_count - 1);
+        }
+
+        void destroy(std::size_t built) {
+            for (std::size_t i = 0; i < built; i++) _shards[i].~S();
+            ::operator delete(_memory);
+        }
+    };
+
+    /**
+     *  Thread-safe map built on independent %hash_map shards.
+     *
+     *  A key's shard is picked from high bits of its mixed hash (just below
+     *  the 7 bits a shard uses as fingerprints), and every shard has its own
+     *  reader/writer lock on a separate cache line, so threads working on
+     *  different shards never contend. Nothing hands out iterators or
+     *  references past the lock: lookups copy the value out and visit()
+     *  runs a callback while the shard is locked. A key is hashed once; the
+     *  hash that picks its shard is passed on to the shard's own lookup.
+     */
+    template<typename K, typename T,
+            typename Hash = std::hash<K>,
+            typename Pred = std::equal_to<K>,
+            typename Alloc = allocator<std::pair<const K, T>>,
+            typename Policy = power_of_two_policy,
+            typename Probing = group_probing>
+    class concurrent_hash_map
+    {
+    public:
+        using map_type = hash_map<K, T, Hash, Pred, Alloc, Policy, Probing>;
+        using key_type = K;
+        using mapped_type = T;
+        using hasher = Hash;
+        using key_equal = Pred;
+        using value_type = typename map_type::value_type;
+        using size_type = std::size_t;
+
+    private:
+        struct alignas(cache_line_size) shard {
+            mutable std::shared_timed_mutex lock;
+            map_type map;
+
+            explicit shard(size_type n) : map(n) {}
+        };
+
+        shard_array<shard> _shards;
+        hasher _hash;
+
+    public:
+        /**
+         *  @brief  Creates an empty map.
+         *  @param  shards  Number of shards, rounded up to a power of two.
+         *  @param  n  Minimal initial number of buckets of every shard.
+         */
+        explicit concurrent_hash_map(size_type shards = 64, size_type n = 0) :
+                _shards(shards, n) {}
+
+        concurrent_hash_map(const concurrent_hash_map&) = delete;
+        concurrent_hash_map& operator=(const concurrent_hash_map&) = delete;
+
+        /// Returns the number of shards.
+        size_type shard_count() const noexcept {
+            return _shards.size();
+        }
+
+        /// Returns the number of elements. Shards are counted one at a time,
+        /// so concurrent writers make the result approximate.
+        size_type size() const {
+            size_type res = 0;
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::shared_lock<std::shared_timed_mutex> guard(_shards[i].lock);
+                res += _shards[i].map.size();
+            }
+            return res;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        /**
+         *  @brief  Copies the value mapped to a key.
+         *  @param  k  Key to be located.
+         *  @param  out  Receives a copy of the mapped value if @a k is present.
+         *  @return  True if @a k was found.
+         */
+        bool find(const key_type& k, mapped_type& out) const {
+            std::size_t hash = _hash(k);
+            const shard& s = _shards.forHash(hash);
+            std::shared_lock<std::shared_timed_mutex> guard(s.lock);
+            auto it = s.map.find(k, hash);
+            if (it == s.map.cend()) return false;
+            out = it->second;
+            return true;
+        }
+
+        bool contains(const key_type& k) const {
+            std::size_t hash = _hash(k);
+            const shard& s = _shards.forHash(hash);
+            std::shared_lock<std::shared_timed_mutex> guard(s.lock);
+            return s.map.contains(k, hash);
+        }
+
+        /// Inserts @a x unless its key is present; returns true if inserted.
+        bool insert(const value_type& x) {
+            std::size_t hash = _hash(x.first);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::shared_timed_mutex> guard(s.lock);
+            return s.map.insert(x, hash).second;
+        }
+
+        bool insert(value_type&& x) {
+            std::size_t hash = _hash(x.first);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::shared_timed_mutex> guard(s.lock);
+            return s.map.insert(std::move(x), hash).second;
+        }
+
+        /// Inserts or overwrites the value of @a k; returns true if inserted.
+        template <typename _Obj>
+        bool insert_or_assign(const key_type& k, _Obj&& obj) {
+            std::size_t hash = _hash(k);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::shared_timed_mutex> guard(s.lock);
+            return s.map.insert_or_assign(k, std::forward<_Obj>(obj), hash).second;
+        }
+
+        /// Erases @a k; returns the number of elements erased (0 or 1).
+        size_type erase(const key_type& k) {
+            std::size_t hash = _hash(k);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::shared_timed_mutex> guard(s.lock);
+            return s.map.erase(k, hash);
+        }
+
+        /**
+         *  @brief  Runs @a f on the element with key @a k under the shard's
+         *          exclusive lock.
+         *  @param  f  Callable taking a value_type&. It must not use this map.
+         *  @return  True if @a k was found and @a f was called.
+         */
+        template<typename F>
+        bool visit(const key_type& k, F&& f) {
+            std::size_t hash = _hash(k);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::shared_timed_mutex> guard(s.lock);
+            auto it = s.map.find(k, hash);
+            if (it == s.map.end()) return false;
+            f(*it);
+            return true;
+        }
+
+        /// Read-only visit() under the shard's shared lock.
+        template<typename F>
+        bool visit(const key_type& k, F&& f) const {
+            std::size_t hash = _hash(k);
+            const shard& s = _shards.forHash(hash);
+            std::shared_lock<std::shared_timed_mutex> guard(s.lock);
+            auto it = s.map.find(k, hash);
+            if (it == s.map.cend()) return false;
+            f(*it);
+            return true;
+        }
+
+        /// Runs @a f on every element, locking one shard at a time.
+        template<typename F>
+        void visit_all(F&& f) {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::lock_guard<std::shared_timed_mutex> guard(_shards[i].lock);
+                for (auto& x : _shards[i].map) f(x);
+            }
+        }
+
+        template<typename F>
+        void visit_all(F&& f) const {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::shared_lock<std::shared_timed_mutex> guard(_shards[i].lock);
+                for (auto it = _shards[i].map.cbegin(); it != _shards[i].map.cend(); ++it) f(*it);
+            }
+        }
+
+        void clear() {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::lock_guard<std::shared_timed_mutex> guard(_shards[i].lock);
+                _shards[i].map.clear();
+            }
+        }
+
+        /// Prepares every shard for its share of @a n elements.
+        void reserve(size_type n) {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::lock_guard<std::shared_timed_mutex> guard(_shards[i].lock);
+                _shards[i].map.reserve(n / _shards.size() + 1);
+            }
+        }
+
+        /// Shrinks every shard to fit its elements, one shard at a time.
+        void shrink_to_fit() {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                std::lock_guard<std::shared_timed_mutex> guard(_shards[i].lock);
+                _shards[i].map.shrink_to_fit();
+            }
+        }
+    };
+
+    /**
+     *  Epoch-based reclamation shared by every optimistic_hash_map.
+     *
+     *  A reader pins the global epoch in a record owned by its thread while
+     *  it may hold pointers to retired memory. Retiring an object stamps it
+     *  with the current epoch and advances it; the object is freed once no
+     *  record is pinned at or before its stamp. Readers only write their own
+     *  record while nothing is waiting to be freed; otherwise a reader
+     *  leaving its outermost guard tries to free what it no longer pins.
+     */
+    class epoch_reclaimer
+    {
+        struct record {
+            std::atomic<std::uint64_t> epoch{0};
+            std::atomic<bool> taken{false};
+            unsigned depth = 0;
+            record* next = nullptr;
+            // Keeps records of different threads off each other's cache lines.
+            char pad[cache_line_size];
+        };
+
+        struct retired {
+            void* p;
+            void (*deleter)(void*);
+            std::uint64_t epoch;
+        };
+
+    public:
+        static epoch_reclaimer& instance() {
+            static epoch_reclaimer reclaimer;
+            return reclaimer;
+        }
+
+        /// Keeps everything retired from now on alive while in scope; nests.
+        class guard
+        {
+        public:
+            explicit guard(epoch_reclaimer& r) : _reclaimer(r), _record(r.local()) {
+                if (_record->depth++ == 0)
+                    _record->epoch.store(r._epoch.load());
+            }
+
+            guard(const guard&) = delete;
+            guard& operator=(const guard&) = delete;
+
+            ~guard() {
+                if (--_record->depth == 0) {
+                    _record->epoch.store(0, std::memory_order_release);
+                    if (_reclaimer._pending.load(std::memory_order_relaxed)) _reclaimer.tryCollect();
+                }
+            }
+
+        private:
+            epoch_reclaimer& _reclaimer;
+            record* _record;
+        };
+
+        /// Frees @a p with @a deleter once no reader can still reach it.
+        void retire(void* p, void (*deleter)(void*)) {
+            std::lock_guard<std::mutex> lock(_retiredLock);
+            _retired.push_back(retired{p, deleter, _epoch.fetch_add(1)});
+            collect();
+        }
+
+        template<typename P>
+        void retire(P* p) {
+            retire(p, [](void* x) { delete static_cast<P*>(x); });
+        }
+
+        epoch_reclaimer(const epoch_reclaimer&) = delete;
+        epoch_reclaimer& operator=(const epoch_reclaimer&) = delete;
+
+        ~epoch_reclaimer() {
+            for (auto& r : _retired) r.deleter(r.p);
+            for (record* r = _records.load(); r;) {
+                record* next = r->next;
+                delete r;
+                r = next;
+            }
+        }
+
+    private:
+        std::atomic<std::uint64_t> _epoch{1};
+        std::atomic<record*> _records{nullptr};
+        std::mutex _retiredLock;
+        std::vector<retired> _retired;
+        // Size of _retired, read by readers without taking the lock.
+        std::atomic<std::size_t> _pending{0};
+
+        epoch_reclaimer() = default;
+
+        // Releases the thread's record when the thread exits.
+        struct owner {
+            record* r;
+
+            explicit owner(epoch_reclaimer& reclaimer) : r(reclaimer.acquire()) {}
+
+            ~owner() {
+                r->taken.store(false, std::memory_order_release);
+            }
+        };
+
+        record* local() {
+            static thread_local owner o(*this);
+            return o.r;
+        }
+
+        // Reuses a record left by an exited thread or publishes a new one.
+        record* acquire() {
+            for (record* r = _records.load(std::memory_order_acquire); r; r = r->next) {
+                bool taken = false;
+                if (!r->taken.load(std::memory_order_relaxed) && r->taken.compare_exchange_strong(taken, true))
+                    return r;
+            }
+            record* r = new record;
+            r->taken.store(true, std::memory_order_relaxed);
+            record* head = _records.load(std::memory_order_relaxed);
+            do {
+                r->next = head;
+            } while (!_records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+            return r;
+        }
+
+        void collect() {
+            std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+            for (record* r = _records.load(std::memory_order_acquire); r; r = r->next) {
+                std::uint64_t e = r->epoch.load();
+                if (e && e < oldest) oldest = e;
+            }
+            size_t kept = 0;
+            for (auto& r : _retired) {
+                if (r.epoch < oldest) r.deleter(r.p);
+                else _retired[kept++] = r;
+            }
+            _retired.resize(kept);
+            _pending.store(kept, std::memory_order_relaxed);
+        }
+
+        // collect() unless another thread is already at it.
+        void tryCollect() {
+            std::unique_lock<std::mutex> lock(_retiredLock, std::try_to_lock);
+            if (lock) collect();
+        }
+    };
+
+    /**
+     *  Sharded map for read-mostly workloads whose lookups take no lock.
+     *
+     *  Each shard guards its %hash_map with a version counter (a seqlock):
+     *  writers serialize on the shard's mutex and make the version odd while
+     *  they change the table in place, and readers copy what they need and
+     *  retry if the version moved. Readers therefore never write a shared
+     *  cache line. A write that would make the table grow instead builds a
+     *  bigger copy, publishes it and retires the old table through
+     *  epoch_reclaimer, so a reader is never left probing freed memory.
+     *
+     *  Readers can observe an element while it is being written, so keys and
+     *  values must be trivially copyable and the hasher and key_equal must
+     *  cope with torn keys (any result is fine, it is discarded).
+     */
+    template<typename K, typename T,
+            typename Hash = std::hash<K>,
+            typename Pred = std::equal_to<K>,
+            typename Alloc = allocator<std::pair<const K, T>>,
+            typename Policy = power_of_two_policy>
+    class optimistic_hash_map
+    {
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<T>::value,
+                      "optimistic_hash_map requires trivially copyable keys and values");
+
+    public:
+        using map_type = hash_map<K, T, Hash, Pred, Alloc, Policy>;
+        using key_type = K;
+        using mapped_type = T;
+        using hasher = Hash;
+        using key_equal = Pred;
+        using value_type = typename map_type::value_type;
+        using size_type = std::size_t;
+
+    private:
+        struct alignas(cache_line_size) shard {
+            std::atomic<std::uint64_t> version{0};
+            std::atomic<map_type*> map;
+            std::mutex lock;
+
+            explicit shard(size_type n) : map(new map_type(n)) {}
+
+            ~shard() {
+                delete map.load(std::memory_order_relaxed);
+            }
+        };
+
+        // Keeps a shard's version odd for the lifetime of an in-place write.
+        class write_scope
+        {
+        public:
+            explicit write_scope(shard& s) : _s(s), _v(s.version.load(std::memory_order_relaxed)) {
+                _s.version.store(_v + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+
+            ~write_scope() {
+                _s.version.store(_v + 2, std::memory_order_release);
+            }
+
+        private:
+            shard& _s;
+            std::uint64_t _v;
+        };
+
+        shard_array<shard> _shards;
+        hasher _hash;
+
+    public:
+        /**
+         *  @brief  Creates an empty map.
+         *  @param  shards  Number of shards, rounded up to a power of two.
+         *  @param  n  Minimal initial number of buckets of every shard.
+         */
+        explicit optimistic_hash_map(size_type shards = 64, size_type n = 0) :
+                _shards(shards, n) {}
+
+        optimistic_hash_map(const optimistic_hash_map&) = delete;
+        optimistic_hash_map& operator=(const optimistic_hash_map&) = delete;
+
+        /// Returns the number of shards.
+        size_type shard_count() const noexcept {
+            return _shards.size();
+        }
+
+        /// Returns the number of elements, approximate under concurrent writes.
+        size_type size() const {
+            size_type res = 0;
+            for (size_type i = 0; i < _shards.size(); i++)
+                res += read(_shards[i], [](const map_type& m) { return m.size(); });
+            return res;
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        /**
+         *  @brief  Copies the value mapped to a key without locking.
+         *  @param  k  Key to be located.
+         *  @param  out  Receives a copy of the mapped value if @a k is present.
+         *  @return  True if @a k was found.
+         */
+        bool find(const key_type& k, mapped_type& out) const {
+            alignas(mapped_type) unsigned char value[sizeof(mapped_type)];
+            std::size_t hash = _hash(k);
+            bool found = read(_shards.forHash(hash), [&](const map_type& m) {
+                auto it = m.find(k, hash);
+                if (it == m.cend()) return false;
+                std::memcpy(value, &it->second, sizeof(mapped_type));
+                return true;
+            });
+            if (found) std::memcpy(&out, value, sizeof(mapped_type));
+            return found;
+        }
+
+        bool contains(const key_type& k) const {
+            std::size_t hash = _hash(k);
+            return read(_shards.forHash(hash), [&](const map_type& m) { return m.contains(k, hash); });
+        }
+
+        /// Inserts @a x unless its key is present; returns true if inserted.
+        bool insert(const value_type& x) {
+            std::size_t hash = _hash(x.first);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::mutex> guard(s.lock);
+            map_type* m = s.map.load(std::memory_order_relaxed);
+            if (m->contains(x.first, hash)) return false;
+            add(s, m, x, hash);
+            return true;
+        }
+
+        /// Inserts or overwrites the value of @a k; returns true if inserted.
+        bool insert_or_assign(const key_type& k, const mapped_type& obj) {
+            std::size_t hash = _hash(k);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::mutex> guard(s.lock);
+            map_type* m = s.map.load(std::memory_order_relaxed);
+            auto it = m->find(k, hash);
+            if (it != m->end()) {
+                write_scope scope(s);
+                it->second = obj;
+                return false;
+            }
+            add(s, m, value_type(k, obj), hash);
+            return true;
+        }
+
+        /// Erases @a k; returns the number of elements erased (0 or 1).
+        size_type erase(const key_type& k) {
+            std::size_t hash = _hash(k);
+            shard& s = _shards.forHash(hash);
+            std::lock_guard<std::mutex> guard(s.lock);
+            map_type* m = s.map.load(std::memory_order_relaxed);
+            if (!m->contains(k, hash)) return 0;
+            write_scope scope(s);
+            return m->erase(k, hash);
+        }
+
+        void clear() {
+            for (size_type i = 0; i < _shards.size(); i++) {
+                shard& s = _shards[i];
+                std::lock_guard<std::mutex> guard(s.lock);
+                write_scope scope(s);
+                s.map.load(std::memory_order_relaxed)->clear();
+            }
+        }
+
+    private:
+        // Runs @a f on a consistent snapshot of the shard's table.
+        template<typename F>
+        auto read(const shard& s, F&& f) const -> decltype(f(std::declval<const map_type&>())) {
+            epoch_reclaimer::guard pin(epoch_reclaimer::instance());
+            for (;;) {
+                std::uint64_t before = s.version.load(std::memory_order_acquire);
+                if (before & 1) continue;
+                auto res = f(*s.map.load());
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (s.version.load(std::memory_order_relaxed) == before) return res;
+            }
+        }
+
+        // Adds a new key: in place if the table has room, otherwise into a
+        // copy that replaces it. The copy drops tombstones, so it only
+        // grows if they don't make up most of the load.
+        void add(shard& s, map_type* m, const value_type& x, std::size_t hash) {
+            if (!m->growthNeeded()) {
+                write_scope scope(s);
+                m->insert(x, hash);
+                return;
+            }
+            std::unique_ptr<map_type> next(new map_type(*m));
+            if (!m->tombstonesDominate()) next->rehash(Policy::grow(m->bucket_count()));
+            next->insert(x, hash);
+            s.map.store(next.release());
+            epoch_reclaimer::instance().retire(m);
+        }
+    };
+
+}
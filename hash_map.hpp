@@ -1,18 +1,271 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <iterator>
 #include <utility>
 #include <type_traits>
-#include <iostream>
-#include <vector>
 #include <cstring>
 #include <cmath>
 #include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <new>
+#include <atomic>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define FEFU_HASH_MAP_STRING_VIEW
+#endif
+
+// Group probing uses SSE2 (16 control bytes per step) when the target has
+// it, AVX2 (32 bytes) when FEFU_HASH_MAP_AVX2 is defined on an AVX2 target,
+// and a portable 8-byte loop otherwise or when FEFU_HASH_MAP_NO_SIMD is set.
+#if !defined(FEFU_HASH_MAP_NO_SIMD) && defined(FEFU_HASH_MAP_AVX2) && defined(__AVX2__)
+#include <immintrin.h>
+#define FEFU_HASH_MAP_GROUP_AVX2
+#elif !defined(FEFU_HASH_MAP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define FEFU_HASH_MAP_GROUP_SSE2
+#endif
 
 namespace fefu
 {
-    enum cellState {_empty, _busy, _freed};
+    /**
+     *  Every slot of a %hash_map owns one control byte. A negative byte is
+     *  one of the sentinels below, a non-negative one marks a busy slot and
+     *  holds the top 7 bits of its key hash (group probing), so probing can
+     *  reject most mismatches without calling the key comparison, or the
+     *  slot's probe distance capped at 127 (Robin Hood probing).
+     */
+    using ctrl_t = signed char;
+    enum cellState : ctrl_t {_empty = -128, _freed = -2};
+
+    /// Assumed size of a cache line, used to keep hot data of different
+    /// threads apart.
+    constexpr std::size_t cache_line_size = 64;
+
+    inline bool isBusy(ctrl_t c) noexcept {
+        return c >= 0;
+    }
+
+    inline int countTrailingZeros(std::uint32_t x) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(x);
+#else
+        int n = 0;
+        for (; !(x & 1u); x >>= 1) n++;
+        return n;
+#endif
+    }
+
+    inline int countLeadingZeros(std::uint32_t x) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clz(x);
+#else
+        int n = 0;
+        for (; !(x & 0x80000000u); x <<= 1) n++;
+        return n;
+#endif
+    }
+
+    /// Asks the CPU to start loading the cache line holding @a p.
+    inline void prefetch(const void* p) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+#elif defined(FEFU_HASH_MAP_GROUP_SSE2) || defined(FEFU_HASH_MAP_GROUP_AVX2)
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#else
+        (void)p;
+#endif
+    }
+
+    /**
+     *  Set of slot offsets inside one probing group, one bit per slot.
+     *  Iterate with lowest() / next() while the mask is non-zero.
+     */
+    template<int Width>
+    class group_mask {
+    public:
+        explicit group_mask(std::uint32_t mask) noexcept : _mask(mask) {}
+
+        explicit operator bool() const noexcept {
+            return _mask != 0;
+        }
+
+        int lowest() const noexcept {
+            return countTrailingZeros(_mask);
+        }
+
+        void next() noexcept {
+            _mask &= _mask - 1;
+        }
+
+        int trailingZeros() const noexcept {
+            return _mask ? countTrailingZeros(_mask) : Width;
+        }
+
+        int leadingZeros() const noexcept {
+            return _mask ? countLeadingZeros(_mask) - (32 - Width) : Width;
+        }
+
+    private:
+        std::uint32_t _mask;
+    };
+
+#if defined(FEFU_HASH_MAP_GROUP_AVX2)
+    class group {
+    public:
+        static constexpr int width = 32;
+        using mask = group_mask<width>;
+
+        explicit group(const ctrl_t* pos) noexcept :
+                _ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos))) {}
+
+        mask match(ctrl_t h) const noexcept {
+            return mask(static_cast<std::uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h), _ctrl))));
+        }
+
+        mask matchEmpty() const noexcept {
+            return match(_empty);
+        }
+
+        // Both sentinels are negative, so the sign bits select them.
+        mask matchNonBusy() const noexcept {
+            return mask(static_cast<std::uint32_t>(_mm256_movemask_epi8(_ctrl)));
+        }
+
+        mask matchBusy() const noexcept {
+            return mask(~static_cast<std::uint32_t>(_mm256_movemask_epi8(_ctrl)));
+        }
+
+    private:
+        __m256i _ctrl;
+    };
+#elif defined(FEFU_HASH_MAP_GROUP_SSE2)
+    class group {
+    public:
+        static constexpr int width = 16;
+        using mask = group_mask<width>;
+
+        explicit group(const ctrl_t* pos) noexcept :
+                _ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+        mask match(ctrl_t h) const noexcept {
+            return mask(static_cast<std::uint32_t>(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), _ctrl))));
+        }
+
+        mask matchEmpty() const noexcept {
+            return match(_empty);
+        }
+
+        // Both sentinels are negative, so the sign bits select them.
+        mask matchNonBusy() const noexcept {
+            return mask(static_cast<std::uint32_t>(_mm_movemask_epi8(_ctrl)));
+        }
+
+        mask matchBusy() const noexcept {
+            return mask(static_cast<std::uint32_t>(_mm_movemask_epi8(_ctrl)) ^ 0xffffu);
+        }
+
+    private:
+        __m128i _ctrl;
+    };
+#else
+    class group {
+    public:
+        static constexpr int width = 8;
+        using mask = group_mask<width>;
+
+        explicit group(const ctrl_t* pos) noexcept {
+            std::memcpy(_ctrl, pos, width);
+        }
+
+        mask match(ctrl_t h) const noexcept {
+            std::uint32_t m = 0;
+            for (int i = 0; i < width; i++)
+                if (_ctrl[i] == h) m |= 1u << i;
+            return mask(m);
+        }
+
+        mask matchEmpty() const noexcept {
+            return match(_empty);
+        }
+
+        mask matchNonBusy() const noexcept {
+            std::uint32_t m = 0;
+            for (int i = 0; i < width; i++)
+                if (!isBusy(_ctrl[i])) m |= 1u << i;
+            return mask(m);
+        }
+
+        mask matchBusy() const noexcept {
+            std::uint32_t m = 0;
+            for (int i = 0; i < width; i++)
+                if (isBusy(_ctrl[i])) m |= 1u << i;
+            return mask(m);
+        }
+
+    private:
+        ctrl_t _ctrl[width];
+    };
+#endif
+
+    // Control bytes of the one-slot table empty maps share until their first
+    // insert: an empty slot and its clones. Never written to.
+    struct empty_group {
+        ctrl_t bytes[group::width];
+
+        constexpr empty_group() : bytes{} {
+            for (ctrl_t& b : bytes) b = _empty;
+        }
+    };
+
+    inline ctrl_t* emptyGroup() noexcept {
+        static constexpr empty_group group{};
+        return const_cast<ctrl_t*>(group.bytes);
+    }
+
+    /**
+     *  Index of the first busy slot at or after from among the size slots
+     *  of a control array, or size. Free slots are skipped a whole group at
+     *  a time, so sparse tables iterate in steps of group::width. The array
+     *  must have the group::width - 1 trailing bytes every table has.
+     */
+    inline std::size_t findNextBusy(const ctrl_t* ctrl, std::size_t from, std::size_t size) noexcept {
+        for (std::size_t pos = from; pos < size; pos += group::width) {
+            auto m = group(ctrl + pos).matchBusy();
+            if (m) {
+                std::size_t index = pos + m.lowest();
+                return index < size ? index : size;
+            }
+        }
+        return size;
+    }
+
+    /**
+     *  Index of the next busy slot after index in a walk over the size
+     *  slots of a control array that begins at start, runs to the end and
+     *  then covers the slots before start; size once the walk is over. An
+     *  index of size_t(-1) stands for the position before the walk.
+     */
+    inline std::size_t findNextInWalk(const ctrl_t* ctrl, std::size_t index, std::size_t start,
+                                      std::size_t size) noexcept {
+        const std::size_t before = static_cast<std::size_t>(-1);
+        if (index == before || index >= start) {
+            std::size_t next = findNextBusy(ctrl, index == before ? start : index + 1, size);
+            if (next != size || start == 0) return next;
+            index = before;
+        }
+        std::size_t next = findNextBusy(ctrl, index + 1, start);
+        return next == start ? size : next;
+    }
 
     template<typename T>
     class allocator {
@@ -29,27 +282,291 @@ namespace fefu
 
         allocator(const allocator&) noexcept = default;
 
+        // Rebinding: a map allocates its tables with an allocator of cache lines.
         template <class U>
-        explicit allocator(const allocator<U>&) noexcept;
+        explicit allocator(const allocator<U>&) noexcept {}
 
         ~allocator() = default;
 
         pointer allocate(size_type n) {
+#ifdef __cpp_aligned_new
+            if (alignof(value_type) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                return static_cast<pointer>(::operator new(n * sizeof(value_type), std::align_val_t(alignof(value_type))));
+            }
+#else
+            // Before C++17 operator new only guarantees max_align_t: take
+            // more and keep what it returned just below the aligned block.
+            if (alignof(value_type) > alignof(std::max_align_t)) {
+                void* raw = ::operator new(n * sizeof(value_type) + alignof(value_type));
+                std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + alignof(value_type))
+                                         & ~std::uintptr_t(alignof(value_type) - 1);
+                reinterpret_cast<void**>(aligned)[-1] = raw;
+                return reinterpret_cast<pointer>(aligned);
+            }
+#endif
             void* p = :: operator new (n * sizeof(value_type));
             return static_cast<pointer>(p);
         }
 
         void deallocate(pointer p, size_type n) noexcept {
+#ifdef __cpp_aligned_new
+            if (alignof(value_type) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                ::operator delete(p, std::align_val_t(alignof(value_type)));
+                return;
+            }
+#else
+            if (alignof(value_type) > alignof(std::max_align_t)) {
+                ::operator delete(reinterpret_cast<void**>(p)[-1]);
+                return;
+            }
+#endif
             ::operator delete(p);
         }
     };
 
+    template<typename T, typename U>
+    bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+        return true;
+    }
+
+    template<typename T, typename U>
+    bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+        return false;
+    }
+
+    /**
+     *  Default capacity policy: bucket counts are rounded up to a power of
+     *  two, the user hash goes through a multiply-xorshift finalizer
+     *  (MurmurHash3 fmix64) and slots are selected with a mask.
+     */
+    struct power_of_two_policy {
+        static std::size_t capacity(std::size_t n) noexcept {
+            std::size_t c = 1;
+            while (c < n) c <<= 1;
+            return c;
+        }
+
+        static std::size_t grow(std::size_t capacity) noexcept {
+            return capacity * 2;
+        }
+
+        static std::size_t mix(std::size_t h) noexcept {
+            std::uint64_t x = h;
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ull;
+            x ^= x >> 33;
+            return static_cast<std::size_t>(x);
+        }
+
+        static std::size_t index(std::size_t h, std::size_t capacity) noexcept {
+            return h & (capacity - 1);
+        }
+
+        // Top 7 bits: the low ones already pick the home slot.
+        static std::size_t fingerprint(std::size_t h) noexcept {
+            return h >> (std::numeric_limits<std::size_t>::digits - 7);
+        }
+    };
+
+    /**
+     *  Opt-in capacity policy for weak hash functions: bucket counts are
+     *  primes, the user hash is used as is and slots are selected with a
+     *  modulo. Every probe step pays an integer division. Fingerprints come
+     *  from the finalized hash, since a weak hash rarely sets its top bits.
+     */
+    struct prime_modulo_policy {
+        static std::size_t capacity(std::size_t n) noexcept {
+            static const std::uint64_t primes[] = {
+                    2, 3, 7, 13, 29, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593,
+                    49157, 98317, 196613, 393241, 786433, 1572869, 3145739, 6291469,
+                    12582917, 25165843, 50331653, 100663319, 201326611, 402653189,
+                    805306457, 1610612741, 3221225473ull, 6442450967ull, 12884901893ull,
+                    25769803799ull, 51539607599ull, 103079215111ull, 206158430209ull,
+                    412316860441ull, 824633720837ull, 1649267441681ull, 3298534883417ull,
+                    6597069766657ull, 13194139533349ull, 26388279066671ull,
+                    52776558133303ull, 105553116266509ull, 211106232533047ull,
+                    422212465066001ull, 844424930132057ull, 1688849860263953ull,
+                    3377699720527897ull, 6755399441055827ull, 13510798882111519ull,
+                    27021597764223071ull, 54043195528445957ull, 108086391056891941ull,
+                    216172782113783843ull, 432345564227567621ull, 864691128455135281ull,
+                    1729382256910270481ull, 3458764513820540933ull,
+                    6917529027641081903ull, 13835058055282163729ull};
+            for (std::uint64_t p : primes)
+                if (p >= n) return static_cast<std::size_t>(p);
+            return std::numeric_limits<std::size_t>::max();
+        }
+
+        // The table roughly doubles, so the next prime is the next step.
+        static std::size_t grow(std::size_t capacity) noexcept {
+            return prime_modulo_policy::capacity(capacity + 1);
+        }
+
+        static std::size_t mix(std::size_t h) noexcept {
+            return h;
+        }
+
+        static std::size_t index(std::size_t h, std::size_t capacity) noexcept {
+            return h % capacity;
+        }
+
+        static std::size_t fingerprint(std::size_t h) noexcept {
+            return power_of_two_policy::fingerprint(power_of_two_policy::mix(h));
+        }
+    };
+
+    template<typename...>
+    struct make_void {
+        using type = void;
+    };
+
+    /// Whether T declares is_transparent, i.e. accepts other types than the
+    /// key it stands for.
+    template<typename T, typename = void>
+    struct has_transparent : std::false_type {};
+
+    template<typename T>
+    struct has_transparent<T, typename make_void<typename T::is_transparent>::type> : std::true_type {};
+
+    // Hashes n bytes a word at a time.
+    inline std::size_t hashBytes(const char* p, std::size_t n) noexcept {
+        const std::uint64_t k = 0x9e3779b97f4a7c15ull;
+        std::uint64_t h = n * k;
+        for (; n >= 8; p += 8, n -= 8) {
+            std::uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * k;
+            h ^= h >> 32;
+        }
+        if (n) {
+            std::uint64_t w = 0;
+            std::memcpy(&w, p, n);
+            h = (h ^ w) * k;
+            h ^= h >> 32;
+        }
+        return static_cast<std::size_t>(h);
+    }
+
+    /**
+     *  Transparent hasher for string keys. std::string, C strings and, from
+     *  C++17, std::string_view hash alike, so a
+     *  hash_map<std::string, T, string_hash, std::equal_to<>> is searched
+     *  with any of them without building a std::string.
+     */
+    struct string_hash {
+        using is_transparent = void;
+
+        std::size_t operator()(const std::string& s) const noexcept {
+            return hashBytes(s.data(), s.size());
+        }
+
+        std::size_t operator()(const char* s) const noexcept {
+            return hashBytes(s, std::strlen(s));
+        }
+
+#ifdef FEFU_HASH_MAP_STRING_VIEW
+        std::size_t operator()(std::string_view s) const noexcept {
+            return hashBytes(s.data(), s.size());
+        }
+#endif
+    };
+
+    /// What a %hash_map passes to its resize hook after each rehash.
+    struct resize_event {
+        std::size_t old_capacity;
+        std::size_t new_capacity;
+        /// Number of elements.
+        std::size_t size;
+        /// Freed slots of the old table dropped by the rehash.
+        std::size_t tombstones;
+        /// Time spent rehashing.
+        std::uint64_t nanoseconds;
+    };
+
+    /**
+     *  Layout of a %hash_map as reported by hash_map::stats(). A probe is
+     *  one group of control bytes with group_probing and one slot with
+     *  robin_hood_probing. Both tables of an incremental rehash are counted.
+     */
+    struct table_stats {
+        std::size_t size;
+        std::size_t capacity;
+        /// Freed slots that still lengthen probe sequences.
+        std::size_t tombstones;
+        /// probe_lengths[d] counts elements d probes past their home.
+        std::vector<std::size_t> probe_lengths;
+        /// Average probes a lookup of a present key takes.
+        double mean_hit_probes;
+        /// Average probes a lookup of an absent key takes.
+        double expected_miss_probes;
+        /// Longest run of slots that are not empty.
+        std::size_t longest_cluster;
+        /// Bytes of the table blocks: slots, control bytes and stored hashes.
+        std::size_t memory_bytes;
+        /// Rehashes since construction.
+        std::size_t rehashes;
+        /// Key searches and the probes they took, including the search an
+        /// insert starts with. Only counted when FEFU_HASH_MAP_COUNTERS is
+        /// defined; every probe then pays a relaxed atomic increment, which
+        /// keeps const lookups from several threads race-free.
+        std::size_t lookups;
+        std::size_t probes;
+    };
+
+    /// Default probing scheme: SIMD group probing, erase leaves tombstones
+    /// where a probe sequence may pass through the slot.
+    struct group_probing {};
+
+    /**
+     *  Robin Hood probing: slots are probed one at a time, an insert takes
+     *  the place of the first element that sits closer to its home slot and
+     *  shifts the rest of the run by one, and erase shifts the run back, so
+     *  no tombstones are ever created. A busy control byte holds the probe
+     *  distance of its element instead of a hash fingerprint, which lets a
+     *  failed lookup stop at the first element closer to home than itself.
+     */
+    struct robin_hood_probing {};
+
+    /// Default hash storage: hashes are recomputed from keys when needed.
+    struct no_stored_hash {};
+
+    /**
+     *  Stored hashes: every slot keeps the hash of its key in an array
+     *  parallel to the slots. Rehashing reads it instead of hashing keys
+     *  again, and a lookup only compares keys whose stored hash matches.
+     *  Worth its sizeof(size_t) per slot for long strings and other keys
+     *  that are slow to hash or compare.
+     */
+    struct stored_hash {};
+
     template<typename K, typename T,
             typename Hash = std::hash<K>,
             typename Pred = std::equal_to<K>,
-            typename Alloc = allocator<std::pair<const K, T>>>
+            typename Alloc = allocator<std::pair<const K, T>>,
+            typename Policy = power_of_two_policy,
+            typename Probing = group_probing,
+            typename HashStorage = no_stored_hash>
     class hash_map;
 
+    template<typename K, typename T,
+            typename Hash = std::hash<K>,
+            typename Pred = std::equal_to<K>,
+            typename Alloc = allocator<std::pair<const K, T>>,
+            typename Policy = power_of_two_policy>
+    using robin_hood_hash_map = hash_map<K, T, Hash, Pred, Alloc, Policy, robin_hood_probing>;
+
+    template<typename K, typename T,
+            typename Hash = std::hash<K>,
+            typename Pred = std::equal_to<K>,
+            typename Alloc = allocator<std::pair<const K, T>>,
+            typename Policy = power_of_two_policy,
+            typename Probing = group_probing>
+    using stored_hash_map = hash_map<K, T, Hash, Pred, Alloc, Policy, Probing, stored_hash>;
+
+    template<typename K, typename T, typename Hash, typename Pred, typename Alloc, typename Policy>
+    class optimistic_hash_map;
+
 
     template<typename ValueType>
     class hash_map_iterator {
@@ -63,7 +580,10 @@ namespace fefu
         template<typename K, typename T,
                 typename Hash,
                 typename Pred,
-                typename Alloc>
+                typename Alloc,
+                typename Policy,
+                typename Probing,
+                typename HashStorage>
         friend class hash_map;
         template<typename V>
         friend class hash_map_const_iterator;
@@ -71,9 +591,16 @@ namespace fefu
         hash_map_iterator() noexcept = default;
         hash_map_iterator(const hash_map_iterator& other) noexcept:
                 _x(other._x),
-                _dataStates(other._dataStates),
+                _ctrl(other._ctrl),
                 _xIndex(other._xIndex),
-                _mapSize(other._mapSize) {}
+                _mapSize(other._mapSize),
+                _start(other._start),
+                _nextX(other._nextX),
+                _nextCtrl(other._nextCtrl),
+                _nextSize(other._nextSize),
+                _nextStart(other._nextStart) {}
+
+        hash_map_iterator& operator=(const hash_map_iterator& other) noexcept = default;
 
         reference operator*() const {
             return *(_x + _xIndex);
@@ -84,13 +611,13 @@ namespace fefu
 
         // prefix ++
         hash_map_iterator& operator++() {
-            for (size_t i = _xIndex + 1; i < _mapSize; i++)
-                if (_dataStates[i] == _busy) {
-                    _xIndex = i;
-                    return *this;
-                }
+            _xIndex = findNextInWalk(_ctrl, _xIndex, _start, _mapSize);
+            if (_xIndex != _mapSize) return *this;
 
-            _xIndex = _mapSize;
+            if (_nextX) {
+                *this = hash_map_iterator(_nextX, static_cast<size_t>(-1), _nextCtrl, _nextSize, _nextStart);
+                return operator++();
+            }
             return *this;
         }
         // postfix ++
@@ -101,27 +628,46 @@ namespace fefu
         }
 
         friend bool operator==(const hash_map_iterator<ValueType>& a,const hash_map_iterator<ValueType>& b) {
-            return (a._x + a._xIndex  == b._x + b._xIndex);
+            // By slot, not address: the shared empty table has no slot array.
+            return a._ctrl == b._ctrl && a._xIndex == b._xIndex;
         }
         friend bool operator!=(const hash_map_iterator<ValueType>& a,const hash_map_iterator<ValueType>& b) {
             return !(a == b);
         }
 
     private:
-        const pointer _x;
-        const cellState* _dataStates;
+        pointer _x;
+        const ctrl_t* _ctrl;
         size_t _xIndex;
         size_t _mapSize;
+        // Slot the walk over the table begins at, see findNextInWalk().
+        size_t _start = 0;
+        // Table iterated after this one while an incremental rehash is
+        // draining the old table into the new one.
+        pointer _nextX = nullptr;
+        const ctrl_t* _nextCtrl = nullptr;
+        size_t _nextSize = 0;
+        size_t _nextStart = 0;
 
         hash_map_iterator(
                 const pointer x,
                 size_t index,
-                const cellState* dataStates,
-                size_t mapSize):
+                const ctrl_t* ctrl,
+                size_t mapSize,
+                size_t start = 0,
+                const pointer nextX = nullptr,
+                const ctrl_t* nextCtrl = nullptr,
+                size_t nextSize = 0,
+                size_t nextStart = 0):
                 _x(x),
-                _dataStates(dataStates),
+                _ctrl(ctrl),
                 _xIndex(index),
-                _mapSize(mapSize) {}
+                _mapSize(mapSize),
+                _start(start),
+                _nextX(nextX),
+                _nextCtrl(nextCtrl),
+                _nextSize(nextSize),
+                _nextStart(nextStart) {}
     };
 
     template<typename ValueType>
@@ -137,21 +683,36 @@ namespace fefu
         template<typename K, typename T,
                 typename Hash,
                 typename Pred,
-                typename Alloc>
+                typename Alloc,
+                typename Policy,
+                typename Probing,
+                typename HashStorage>
         friend class hash_map;
 
         hash_map_const_iterator() noexcept = default;
         hash_map_const_iterator(const hash_map_const_iterator& other) noexcept :
                 _x(other._x),
-                _dataStates(other._dataStates),
+                _ctrl(other._ctrl),
                 _xIndex(other._xIndex),
-                _mapSize(other._mapSize) {}
+                _mapSize(other._mapSize),
+                _start(other._start),
+                _nextX(other._nextX),
+                _nextCtrl(other._nextCtrl),
+                _nextSize(other._nextSize),
+                _nextStart(other._nextStart) {}
 
         hash_map_const_iterator(const hash_map_iterator<ValueType>& other) noexcept :
                 _x(other._x),
-                _dataStates(other._dataStates),
+                _ctrl(other._ctrl),
                 _xIndex(other._xIndex),
-                _mapSize(other._mapSize) {}
+                _mapSize(other._mapSize),
+                _start(other._start),
+                _nextX(other._nextX),
+                _nextCtrl(other._nextCtrl),
+                _nextSize(other._nextSize),
+                _nextStart(other._nextStart) {}
+
+        hash_map_const_iterator& operator=(const hash_map_const_iterator& other) noexcept = default;
 
         reference operator*() const {
             return *(_x + _xIndex);
@@ -162,13 +723,13 @@ namespace fefu
 
         // prefix ++
         hash_map_const_iterator& operator++() {
-            for (size_t i = _xIndex + 1; i < _mapSize; i++)
-                if (_dataStates[i] == _busy) {
-                    _xIndex = i;
-                    return *this;
-                }
+            _xIndex = findNextInWalk(_ctrl, _xIndex, _start, _mapSize);
+            if (_xIndex != _mapSize) return *this;
 
-            _xIndex = _mapSize;
+            if (_nextX) {
+                *this = hash_map_const_iterator(_nextX, static_cast<size_t>(-1), _nextCtrl, _nextSize, _nextStart);
+                return operator++();
+            }
             return *this;
         }
         // postfix ++
@@ -179,33 +740,51 @@ namespace fefu
         }
 
         friend bool operator==(const hash_map_const_iterator<ValueType>& a, const hash_map_const_iterator<ValueType>& b) {
-            return (a._x + a._xIndex  == b._x + b._xIndex);
+            return a._ctrl == b._ctrl && a._xIndex == b._xIndex;
         }
         friend bool operator!=(const hash_map_const_iterator<ValueType>& a, const hash_map_const_iterator<ValueType>& b) {
             return !(a == b);
         }
 
     private:
-        const pointer _x;
-        const cellState* _dataStates;
+        pointer _x;
+        const ctrl_t* _ctrl;
         size_t _xIndex;
         size_t _mapSize;
+        size_t _start = 0;
+        pointer _nextX = nullptr;
+        const ctrl_t* _nextCtrl = nullptr;
+        size_t _nextSize = 0;
+        size_t _nextStart = 0;
 
         hash_map_const_iterator(
                 const pointer x,
                 size_t index,
-                const cellState* dataStates,
-                size_t mapSize):
+                const ctrl_t* ctrl,
+                size_t mapSize,
+                size_t start = 0,
+                const pointer nextX = nullptr,
+                const ctrl_t* nextCtrl = nullptr,
+                size_t nextSize = 0,
+                size_t nextStart = 0):
                 _x(x),
-                _dataStates(dataStates),
+                _ctrl(ctrl),
                 _xIndex(index),
-                _mapSize(mapSize) {}
+                _mapSize(mapSize),
+                _start(start),
+                _nextX(nextX),
+                _nextCtrl(nextCtrl),
+                _nextSize(nextSize),
+                _nextStart(nextStart) {}
     };
 
     template<typename K, typename T,
             typename Hash,
             typename Pred,
-            typename Alloc>
+            typename Alloc,
+            typename Policy,
+            typename Probing,
+            typename HashStorage>
     class hash_map
     {
     public:
@@ -214,31 +793,99 @@ namespace fefu
         using hasher = Hash;
         using key_equal = Pred;
         using allocator_type = Alloc;
+        using capacity_policy = Policy;
+        using probing = Probing;
+        using hash_storage = HashStorage;
         using value_type = std::pair<const key_type, mapped_type>;
         using reference = value_type&;
         using const_reference = const value_type&;
         using iterator = hash_map_iterator<value_type>;
         using const_iterator = hash_map_const_iterator<value_type>;
         using size_type = std::size_t;
+        /// Resize hook: the event and the context registered with it.
+        using resize_hook = void (*)(const resize_event&, void*);
 
     private:
+        template<typename, typename, typename, typename, typename, typename>
+        friend class optimistic_hash_map;
+
+        // Lets a lookup take any _Kt when both Hash and Pred are transparent,
+        // as in the C++20 unordered containers. Naming _Kt keeps the check
+        // in the immediate context of the overload.
+        template<typename _Kt, typename _Res = void>
+        using if_transparent = typename std::enable_if<
+                has_transparent<typename std::conditional<true, Hash, _Kt>::type>::value
+                && has_transparent<typename std::conditional<true, Pred, _Kt>::type>::value, _Res>::type;
+
+        // A table is a single block of Alloc memory made of whole cache
+        // lines: control bytes, then the slots from the next line boundary
+        // on, then the stored hashes if there are any.
+        static constexpr size_type blockAlign =
+                alignof(value_type) > cache_line_size ? alignof(value_type) : cache_line_size;
+
+        struct alignas(blockAlign) block_unit {
+            unsigned char bytes[blockAlign];
+        };
+
+        using block_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<block_unit>;
+
+        // The empty functors share their word with the load factor.
         allocator_type _allocator = allocator_type();
-        value_type* _data = _allocator.allocate(10);
-        cellState* _cellsState = new cellState[10];
+        hasher _hash;
+        key_equal _equal;
         float _loadFactor = 0.75;
+        size_type _bucketCount = 16;
+        value_type* _data = nullptr;
+        ctrl_t* _ctrl = nullptr;
         size_type _elementCount = 0;
         size_type _deletedElementCount = 0;
-        size_type _bucketCount = 10;
-        hasher _hash;
-        key_equal _equal;
+        size_type _rehashes = 0;
+
+        // Slot array, control bytes and capacity of one table, plus the
+        // hash of every slot with stored_hash.
+        struct table {
+            value_type* data;
+            ctrl_t* ctrl;
+            size_type capacity;
+            size_t* hashes;
+        };
+
+        // State of incremental rehashing, the resize hook and the shrink
+        // policy. Most maps use none of them, so it is kept out of line and
+        // only allocated once one is switched on.
+        struct rare_state {
+            bool incremental = false;
+            // Incremental rehash: the table being drained, the next slot to
+            // move and how many slots are left.
+            table old = table{nullptr, nullptr, 0, nullptr};
+            size_type migratePos = 0;
+            size_type migrateLeft = 0;
+
+            resize_hook onResize = nullptr;
+            void* onResizeContext = nullptr;
+
+            float minLoadFactor = 0;
+            // Size when the table last grew; shrinking waits until the map
+            // has lost elements since.
+            size_type grownAt = 0;
+        };
+
+        std::unique_ptr<rare_state> _rare;
+#ifdef FEFU_HASH_MAP_COUNTERS
+        // Relaxed atomics: shared-locked and optimistic readers of the
+        // concurrent maps count from several threads at once.
+        mutable std::atomic<size_type> _lookups{0};
+        mutable std::atomic<size_type> _probes{0};
+#endif
 
     public:
-        /// Default constructor.
-        hash_map() : hash_map(10) {}
+        /// Default constructor. Allocates nothing until the first insert.
+        hash_map() : hash_map(0) {}
 
         /**
          *  @brief  Default constructor creates no elements.
-         *  @param n  Minimal initial number of buckets.
+         *  @param n  Minimal initial number of buckets; with 0 nothing is
+         *            allocated until the first insert.
          */
         explicit hash_map(size_type n): hash_map(n, allocator_type()) {}
 
@@ -260,16 +907,18 @@ namespace fefu
         /// Copy constructor.
         hash_map(const hash_map& tmp) : hash_map(tmp, tmp.get_allocator()) {}
 
-        /// Move constructor.
-        hash_map(hash_map&& map) : hash_map() {
+        /// Move constructor. Leaves @a map empty; allocates nothing.
+        hash_map(hash_map&& map) noexcept : hash_map(0, map.get_allocator()) {
             swap(map);
         }
 
         /**
          *  @brief Creates an %hash_map with no elements.
          *  @param a An allocator object.
+         *
+         *  Allocates nothing until the first insert.
          */
-        explicit hash_map(const allocator_type& a) : hash_map(10, a) {}
+        explicit hash_map(const allocator_type& a) : hash_map(0, a) {}
 
         /**
         *  @brief Copy constructor with allocator argument.
@@ -277,9 +926,17 @@ namespace fefu
         *  @param  a  An allocator object.
         */
         hash_map(const hash_map& umap,
-                 const allocator_type& a) : hash_map(umap.bucket_count(), a) {
+                 const allocator_type& a) : hash_map(umap.empty() ? 0 : umap.bucket_count(), a) {
             _hash = umap._hash;
             _equal = umap._equal;
+            _loadFactor = umap._loadFactor;
+            if (umap._rare) {
+                rare_state& r = rare();
+                r.incremental = umap._rare->incremental;
+                r.onResize = umap._rare->onResize;
+                r.onResizeContext = umap._rare->onResizeContext;
+                r.minLoadFactor = umap._rare->minLoadFactor;
+            }
             insert(umap.cbegin(), umap.cend());
         }
 
@@ -363,8 +1020,14 @@ namespace fefu
          *  %hash_map.
          */
         iterator begin() noexcept {
-            size_type index = findFirstBusyCell();
-            return hash_map_iterator<value_type>(_data, index, _cellsState, bucket_count());
+            if (draining()) {
+                const table& old = _rare->old;
+                iterator it(old.data, static_cast<size_type>(-1), old.ctrl, old.capacity, walkStart(old),
+                            _data, _ctrl, bucket_count(), walkStart(current()));
+                return ++it;
+            }
+            iterator it(_data, static_cast<size_type>(-1), _ctrl, bucket_count(), walkStart(current()));
+            return ++it;
         }
 
         //@{
@@ -377,8 +1040,14 @@ namespace fefu
         }
 
         const_iterator cbegin() const noexcept {
-            size_type index = findFirstBusyCell();
-            return hash_map_const_iterator<value_type>(_data, index, _cellsState, bucket_count());
+            if (draining()) {
+                const table& old = _rare->old;
+                const_iterator it(old.data, static_cast<size_type>(-1), old.ctrl, old.capacity, walkStart(old),
+                                  _data, _ctrl, bucket_count(), walkStart(current()));
+                return ++it;
+            }
+            const_iterator it(_data, static_cast<size_type>(-1), _ctrl, bucket_count(), walkStart(current()));
+            return ++it;
         }
 
         /**
@@ -386,7 +1055,7 @@ namespace fefu
          *  the %hash_map.
          */
         iterator end() noexcept {
-            return hash_map_iterator<value_type>(_data, bucket_count(), _cellsState, bucket_count());
+            return hash_map_iterator<value_type>(_data, bucket_count(), _ctrl, bucket_count());
         }
 
         //@{
@@ -399,7 +1068,7 @@ namespace fefu
         }
 
         const_iterator cend() const noexcept {
-            return hash_map_const_iterator<value_type>(_data, bucket_count(), _cellsState, bucket_count());
+            return hash_map_const_iterator<value_type>(_data, bucket_count(), _ctrl, bucket_count());
         }
         //@}
 
@@ -422,12 +1091,17 @@ namespace fefu
         *  An %hash_map relies on unique keys and thus a %pair is only
         *  inserted if its first element (the key) is not already present in the
         *  %hash_map.
+        *  When @a args are a key and a value, or a single pair, the key is
+        *  looked up first and the element is only built if the key is
+        *  absent: directly in its slot, unless other elements have to move
+        *  to make room for it. @a args may refer to an element of the
+        *  %hash_map.
         *
         *  Insertion requires amortized constant time.
         */
         template<typename... _Args>
         std::pair<iterator, bool> emplace(_Args&&... args) {
-            return insert(value_type(std::forward<_Args>(args)...));
+            return common_emplace(std::forward<_Args>(args)...);
         }
 
         /**
@@ -454,13 +1128,13 @@ namespace fefu
          */
         template <typename... _Args>
         std::pair<iterator, bool> try_emplace(const key_type& k, _Args&&... args) {
-            return common_try_emplace(key_type(k), std::move(args)...);
+            return common_try_emplace(k, std::forward<_Args>(args)...);
         }
 
         // move-capable overload
         template <typename... _Args>
         std::pair<iterator, bool> try_emplace(key_type&& k, _Args&&... args) {
-            return common_try_emplace(std::move(k), std::move(args)...);
+            return common_try_emplace(std::move(k), std::forward<_Args>(args)...);
         }
 
         //@{
@@ -481,13 +1155,33 @@ namespace fefu
         *  Insertion requires amortized constant time.
         */
         std::pair<iterator, bool> insert(const value_type& x) {
-            return common_insert(value_type(x));
+            return common_insert(x, hashFun(x.first));
         }
 
         std::pair<iterator, bool> insert(value_type&& x) {
-            return common_insert(std::move(x));
+            return common_insert(std::move(x), hashFun(x.first));
+        }
+
+        //@}
+
+        //@{
+        /**
+         *  @brief Attempts to insert a std::pair whose key the caller has
+         *  already hashed.
+         *  @param  x  Pair to be inserted.
+         *  @param  hash  hash_function()(x.first).
+         *  @return  As for insert(x).
+         *
+         *  The key is not hashed again. A @a hash that does not match the key
+         *  leaves the element unreachable by ordinary lookups.
+         */
+        std::pair<iterator, bool> insert(const value_type& x, size_t hash) {
+            return common_insert(x, Policy::mix(hash));
         }
 
+        std::pair<iterator, bool> insert(value_type&& x, size_t hash) {
+            return common_insert(std::move(x), Policy::mix(hash));
+        }
         //@}
 
         /**
@@ -540,14 +1234,34 @@ namespace fefu
          */
         template <typename _Obj>
         std::pair<iterator, bool> insert_or_assign(const key_type& k, _Obj&& obj) {
-            return common_insert_or_assign<_Obj>(key_type(k), std::forward<_Obj>(obj));
+            return common_insert_or_assign(k, std::forward<_Obj>(obj), hashFun(k));
         }
 
         // move-capable overload
         template <typename _Obj>
         std::pair<iterator, bool> insert_or_assign(key_type&& k, _Obj&& obj) {
-            return common_insert_or_assign<_Obj>(std::move(k), std::forward<_Obj>(obj));
+            size_t hash = hashFun(k);
+            return common_insert_or_assign(std::move(k), std::forward<_Obj>(obj), hash);
+        }
+
+        //@{
+        /**
+         *  @brief insert_or_assign() for a key the caller has already hashed.
+         *  @param  k  Key to use for finding a possibly existing pair.
+         *  @param  obj  Argument used to generate or assign the .second.
+         *  @param  hash  hash_function()(k).
+         *  @return  As for insert_or_assign(k, obj).
+         */
+        template <typename _Obj>
+        std::pair<iterator, bool> insert_or_assign(const key_type& k, _Obj&& obj, size_t hash) {
+            return common_insert_or_assign(k, std::forward<_Obj>(obj), Policy::mix(hash));
+        }
+
+        template <typename _Obj>
+        std::pair<iterator, bool> insert_or_assign(key_type&& k, _Obj&& obj, size_t hash) {
+            return common_insert_or_assign(std::move(k), std::forward<_Obj>(obj), Policy::mix(hash));
         }
+        //@}
 
         //@{
         /**
@@ -558,17 +1272,23 @@ namespace fefu
          *          element exists, end() is returned.
          *
          *  This function erases an element, pointed to by the given iterator,
-         *  from an %hash_map.
+         *  from an %hash_map. It works from the slot the iterator refers to
+         *  and does not look the key up again. With robin_hood_probing the
+         *  elements after @a position may shift back by one slot, but the
+         *  returned iterator still goes on to every element not yet visited,
+         *  each exactly once.
+         *  Erasing never advances an incremental rehash, so iterators other
+         *  than @a position stay valid.
          *  Note that this function only erases the element, and that if the
          *  element is itself a pointer, the pointed-to memory is not touched in
          *  any way.  Managing the pointer is the user's responsibility.
          */
         iterator erase(const_iterator position) {
-            auto res = ++(find(position->first));
-            destroy_at(_data + position._xIndex);
-            _cellsState[position._xIndex] = _freed;
-            _elementCount--;
-            _deletedElementCount++;
+            iterator res = mutableIterator(position);
+            eraseAt(tableOf(position._ctrl), position._xIndex);
+
+            // Robin Hood erase may have shifted the next element into the slot.
+            if (!isBusy(position._ctrl[position._xIndex])) ++res;
             return res;
         }
 
@@ -591,12 +1311,23 @@ namespace fefu
          *  any way.  Managing the pointer is the user's responsibility.
          */
         size_type erase(const key_type& x) {
-            auto iterator = find(x);
-            if (iterator != end()) {
-                erase(iterator);
-                return 1;
-            }
-            return 0;
+            return common_erase(x, hashFun(x));
+        }
+
+        template<typename _Kt, typename = if_transparent<_Kt>,
+                typename = typename std::enable_if<!std::is_convertible<const _Kt&, const_iterator>::value>::type>
+        size_type erase(const _Kt& x) {
+            return common_erase(x, hashFun(x));
+        }
+
+        /**
+         *  @brief Erases the element with a key the caller has already hashed.
+         *  @param  x  Key of element to be erased.
+         *  @param  hash  hash_function()(x).
+         *  @return  The number of elements erased.
+         */
+        size_type erase(const key_type& x, size_t hash) {
+            return common_erase(x, Policy::mix(hash));
         }
 
         /**
@@ -608,16 +1339,29 @@ namespace fefu
          *                be erased.
          *  @return The iterator @a last.
          *
-         *  This function erases a sequence of elements from an %hash_map.
+         *  This function erases a sequence of elements from an %hash_map,
+         *  walking the control bytes from @a first without any lookups.
          *  Note that this function only erases the elements, and that if
          *  the element is itself a pointer, the pointed-to memory is not touched
          *  in any way.  Managing the pointer is the user's responsibility.
          */
         iterator erase(const_iterator first, const_iterator last) {
-            for (auto& i = first; i != last; ++i) {
-                erase(i);
-            }
-            return find(last->first);
+            return eraseRange(first, last, Probing());
+        }
+
+        /**
+         *  @brief Erases every element that satisfies a predicate.
+         *  @param  pred  Predicate called with a reference to each element.
+         *  @return  The number of elements erased.
+         *
+         *  The table is swept once, slot by slot; no keys are hashed or looked
+         *  up. @a pred is called exactly once per element.
+         */
+        template<typename Predicate>
+        size_type erase_if(Predicate pred) {
+            size_type erased = 0;
+            if (draining()) erased += eraseIf(_rare->old, pred);
+            return erased + eraseIf(current(), pred);
         }
 
         /**
@@ -627,15 +1371,19 @@ namespace fefu
          *  in any way.  Managing the pointer is the user's responsibility.
          */
         void clear() noexcept {
-            for (auto i = 0; i < bucket_count(); ++i) {
-                if (_cellsState[i] == _busy) {
-                    destroy_at(_data + i);
-                }
-                _cellsState[i] = _empty;
-            }
-
+            destroyAll();
             _deletedElementCount = 0;
             _elementCount = 0;
+            if (!ownsBlock(current())) return;
+
+            // Goes back to the shared empty table without reporting a resize;
+            // nothing is allocated.
+            if (min_load_factor() > 0) {
+                release(current());
+                setCurrent(emptyTable());
+            } else {
+                std::memset(_ctrl, _empty, ctrlSize(bucket_count()));
+            }
         }
 
         /**
@@ -651,27 +1399,38 @@ namespace fefu
         void swap(hash_map& x) {
             std::swap(_allocator, x._allocator);
             std::swap(_data, x._data);
-            std::swap(_cellsState, x._cellsState);
+            std::swap(_ctrl, x._ctrl);
             std::swap(_loadFactor, x._loadFactor);
             std::swap(_elementCount, x._elementCount);
             std::swap(_deletedElementCount, x._deletedElementCount);
             std::swap(_hash, x._hash);
             std::swap(_equal, x._equal);
             std::swap(_bucketCount, x._bucketCount);
+            std::swap(_rehashes, x._rehashes);
+            std::swap(_rare, x._rare);
+#ifdef FEFU_HASH_MAP_COUNTERS
+            _lookups.store(x._lookups.exchange(_lookups.load(std::memory_order_relaxed), std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+            _probes.store(x._probes.exchange(_probes.load(std::memory_order_relaxed), std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+#endif
         }
 
         template<typename _H2, typename _P2>
-        void merge(hash_map<K, T, _H2, _P2, Alloc>& source) {
-            for (auto i = source.begin(); i != source.end(); ++i) {
+        void merge(hash_map<K, T, _H2, _P2, Alloc, Policy, Probing, HashStorage>& source) {
+            // Robin Hood erase may shift the next element into i.
+            for (auto i = source.begin(); i != source.end();) {
                 auto res = insert(*i);
                 if (res.second) {
-                    source.erase(i);
+                    i = source.erase(i);
+                } else {
+                    ++i;
                 }
             }
         }
 
         template<typename _H2, typename _P2>
-        void merge(hash_map<K, T, _H2, _P2, Alloc>&& source) {
+        void merge(hash_map<K, T, _H2, _P2, Alloc, Policy, Probing, HashStorage>&& source) {
             insert(source.cbegin(), source.cend());
         }
 
@@ -704,23 +1463,55 @@ namespace fefu
          *  past-the-end ( @c end() ) iterator.
          */
         iterator find(const key_type& x) {
-            size_type index = bucket(x);
-            if (_cellsState[index] == _busy) {
-                return hash_map_iterator<value_type>(_data, index, _cellsState, _bucketCount);
-            } else {
-                return end();
-            }
+            size_t hash = hashFun(x);
+            table t = current();
+            return iteratorAt(t, locate(t, x, hash));
         }
 
         const_iterator find(const key_type& x) const {
-            size_type index = bucket(x);
-            if (_cellsState[index] == _busy) {
-                return hash_map_const_iterator<value_type>(_data, index, _cellsState, _bucketCount);
-            } else {
-                return cend();
-            }
+            size_t hash = hashFun(x);
+            table t = current();
+            return iteratorAt(t, locate(t, x, hash));
+        }
+
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        iterator find(const _Kt& x) {
+            size_t hash = hashFun(x);
+            table t = current();
+            return iteratorAt(t, locate(t, x, hash));
+        }
+
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        const_iterator find(const _Kt& x) const {
+            size_t hash = hashFun(x);
+            table t = current();
+            return iteratorAt(t, locate(t, x, hash));
+        }
+
+        //@}
+
+        //@{
+        /**
+         *  @brief Tries to locate an element with a key the caller has
+         *  already hashed.
+         *  @param  x  Key to be located.
+         *  @param  hash  hash_function()(x).
+         *  @return  Iterator pointing to sought-after element, or end() if not
+         *           found.
+         *
+         *  A key hashed once, for instance to pick a shard, can be looked up
+         *  in any number of maps that use an equal hasher without being
+         *  hashed again.
+         */
+        iterator find(const key_type& x, size_t hash) {
+            table t = current();
+            return iteratorAt(t, locate(t, x, Policy::mix(hash)));
         }
 
+        const_iterator find(const key_type& x, size_t hash) const {
+            table t = current();
+            return iteratorAt(t, locate(t, x, Policy::mix(hash)));
+        }
         //@}
 
         /**
@@ -736,16 +1527,80 @@ namespace fefu
             return contains(x) ? 1 : 0;
         }
 
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        size_type count(const _Kt& x) const {
+            return contains(x) ? 1 : 0;
+        }
+
         /**
          *  @brief  Finds whether an element with the given key exists.
          *  @param  x  Key of elements to be located.
          *  @return  True if there is any element with the specified key.
          */
         bool contains(const key_type& x) const {
-            size_type index = bucket(x);
-            return _cellsState[index] == _busy;
+            table t = current();
+            return locate(t, x, hashFun(x)) != t.capacity;
+        }
+
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        bool contains(const _Kt& x) const {
+            table t = current();
+            return locate(t, x, hashFun(x)) != t.capacity;
+        }
+
+        /// contains() for a key the caller has already hashed with
+        /// hash_function().
+        bool contains(const key_type& x, size_t hash) const {
+            table t = current();
+            return locate(t, x, Policy::mix(hash)) != t.capacity;
+        }
+
+        //@{
+        /**
+         *  @brief  Looks up a batch of keys.
+         *  @param  first  Start of a forward range of keys.
+         *  @param  last  End of the range.
+         *  @param  out  Receives, for every key in order, an iterator to its
+         *               element or end().
+         *  @return  @a out past the last written iterator.
+         *
+         *  Keys are resolved in windows of batch_window: a whole window is
+         *  hashed and the control bytes and home slots of its keys are
+         *  prefetched before any of them is probed, so the cache misses of a
+         *  window overlap instead of stalling one lookup after another.
+         */
+        template<typename ForwardIt, typename OutputIt>
+        OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) {
+            batchLocate(first, last, [&](table& t, size_type index) {
+                *out++ = iteratorAt(t, index);
+            });
+            return out;
         }
 
+        template<typename ForwardIt, typename OutputIt>
+        OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) const {
+            batchLocate(first, last, [&](table& t, size_type index) {
+                *out++ = iteratorAt(t, index);
+            });
+            return out;
+        }
+        //@}
+
+        /**
+         *  @brief  Batched contains(), see find_many().
+         *  @return  @a out past the last written flag.
+         */
+        template<typename ForwardIt, typename OutputIt>
+        OutputIt contains_many(ForwardIt first, ForwardIt last, OutputIt out) const {
+            batchLocate(first, last, [&](table& t, size_type index) {
+                *out++ = index != t.capacity;
+            });
+            return out;
+        }
+
+        /// Number of keys find_many() hashes and prefetches ahead of probing.
+        static constexpr size_type batch_window = 16;
+
         //@{
         /**
          *  @brief  Subscript ( @c [] ) access to %hash_map data.
@@ -760,13 +1615,11 @@ namespace fefu
          *  Lookup requires constant time.
          */
         mapped_type& operator[](const key_type& k) {
-            auto res = insert(value_type{k, mapped_type()});
-            return res.first->second;
+            return try_emplace(k).first->second;
         }
 
         mapped_type& operator[](key_type&& k) {
-            auto res = insert(value_type{std::move(k), mapped_type()});
-            return res.first->second;
+            return try_emplace(std::move(k)).first->second;
         }
         //@}
 
@@ -785,6 +1638,16 @@ namespace fefu
         const mapped_type& at(const key_type& k) const {
             return common_at(k);
         }
+
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        mapped_type& at(const _Kt& k) {
+            return common_at(k);
+        }
+
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        const mapped_type& at(const _Kt& k) const {
+            return common_at(k);
+        }
         //@}
 
         // bucket interface.at
@@ -797,17 +1660,17 @@ namespace fefu
         /*
         * @brief  Returns the bucket index of a given element.
         * @param  _K  A key instance.
-        * @return  The key bucket index.
+        * @return  The index of the slot holding the key, or of the slot
+        *          it would be inserted into if absent. During an incremental
+        *          rehash only the new table is searched.
         */
         size_type bucket(const key_type& _K) const {
-            size_type index = hashFun(_K);
-
-            while (!_equal(_K, _data[index].first) &&
-                   (_cellsState[index] == _busy || _cellsState[index] == _freed)) {
-                index = (index + 1) % bucket_count();
-            }
+            return common_bucket(_K);
+        }
 
-            return index;
+        template<typename _Kt, typename = if_transparent<_Kt>>
+        size_type bucket(const _Kt& _K) const {
+            return common_bucket(_K);
         }
 
         // hash policy.
@@ -831,135 +1694,1145 @@ namespace fefu
             _loadFactor = z;
         }
 
+        /// Returns the load factor below which the %hash_map shrinks, 0 if
+        /// it never shrinks on its own.
+        float min_load_factor() const noexcept {
+            return _rare ? _rare->minLoadFactor : 0;
+        }
+
         /**
-         *  @brief  May rehash the %hash_map.
-         *  @param  n The new number of buckets.
+         *  @brief  Lets the %hash_map release memory as it empties.
+         *  @param  z  Fraction of the buckets that must stay occupied; 0,
+         *             the default, turns shrinking off.
          *
-         *  Rehash will occur only if the new number of buckets respect the
-         *  %hash_map maximum load factor.
+         *  Once fewer than z * bucket_count() elements are left and the map
+         *  has lost elements since it last grew, the next insert rehashes
+         *  into a table at half the maximum load factor but no smaller
+         *  than the first table a map allocates, so the map has to grow or
+         *  lose most of its elements again before the next resize. clear()
+         *  releases the table altogether. z should stay well below a
+         *  quarter of max_load_factor(). Erase never shrinks, so iterators
+         *  stay valid across it.
          */
-        void rehash(size_type n) {
-            if (static_cast<float>(loadCells()) / n > max_load_factor()) return; // Проверка на малое кол-во бакетов.
-            std::vector<value_type> tmp(begin(), end());
-            destroy();
-            _data = _allocator.allocate(n);
-            _cellsState = new cellState[n];
-            _bucketCount = n;
-            insert(tmp.cbegin(), tmp.cend());
+        void min_load_factor(float z) {
+            if (_rare || z != 0) rare().minLoadFactor = z;
         }
 
         /**
-         *  @brief  Prepare the %hash_map for a specified number of
-         *          elements.
-         *  @param  n Number of elements required.
+         *  @brief  Rehashes into the smallest table holding the elements
+         *          within max_load_factor().
          *
-         *  Same as rehash(ceil(n / max_load_factor())).
+         *  Also drops tombstones and finishes an incremental rehash. An
+         *  empty %hash_map releases its table.
          */
-        void reserve(size_type n) {
-            rehash(ceil(n / max_load_factor()));
-        }
-
-        bool operator==(const hash_map& other) const {
-            if (size() != other.size()) return false;
-
-            for(auto& i : other) {
-                auto tmp = find(i.first);
-                if (tmp == end()) return false;
-                if (tmp->second != i.second) return false;
+        void shrink_to_fit() {
+            if (empty()) {
+                rehash(0);
+                return;
             }
+            size_type n = Policy::capacity(static_cast<size_type>(std::ceil(size() / max_load_factor())));
+            if (n < bucket_count() || _deletedElementCount || draining()) rehash(n);
+        }
 
-            return true;
+        /**
+         *  @brief  Scans the table and reports how it is laid out.
+         *
+         *  Long probe sequences or clusters at a moderate load factor point
+         *  to a weak hash function; many tombstones to erase-heavy use.
+         *  Linear in bucket_count().
+         */
+        table_stats stats() const {
+            table_stats res{};
+            res.size = size();
+            res.capacity = bucket_count();
+            res.tombstones = _deletedElementCount;
+            res.rehashes = _rehashes;
+#ifdef FEFU_HASH_MAP_COUNTERS
+            res.lookups = _lookups.load(std::memory_order_relaxed);
+            res.probes = _probes.load(std::memory_order_relaxed);
+#endif
+            size_type hitProbes = 0;
+            scanTable(current(), res, hitProbes);
+            if (draining()) scanTable(_rare->old, res, hitProbes);
+            res.mean_hit_probes = res.size ? static_cast<double>(hitProbes) / res.size : 0;
+            return res;
         }
 
-        ~hash_map() {
-            destroy();
+        /// Returns true if growth is spread over subsequent inserts.
+        bool incremental_rehash() const noexcept {
+            return _rare && _rare->incremental;
         }
 
-    private:
+        /**
+         *  @brief  Switch incremental rehashing on or off.
+         *  @param  on  Whether growth should be incremental.
+         *
+         *  When on, a growing %hash_map allocates the new table and keeps the
+         *  old one alive; every insert then moves a bounded number of old
+         *  slots over and lookups consult both tables until the old one is
+         *  drained, so no single insert pays for the whole table. Switching
+         *  it off finishes a rehash in progress.
+         */
+        void incremental_rehash(bool on) {
+            if (_rare || on) rare().incremental = on;
+            if (!on) migrate(std::numeric_limits<size_type>::max());
+        }
+
+        /**
+         *  @brief  Registers a callback run after every rehash.
+         *  @param  hook  Function called with the event and @a context, or
+         *                nullptr to stop reporting.
+         *  @param  context  Passed to @a hook as is.
+         *
+         *  Growth, rehash() and reserve() all report. With incremental
+         *  rehashing the event covers switching to the new table; moving
+         *  the elements is spread over later inserts. Without a hook
+         *  resizing reads no clock. Copies of the %hash_map keep the hook
+         *  and its context.
+         */
+        void on_resize(resize_hook hook, void* context = nullptr) {
+            if (!_rare && !hook) return;
+            rare_state& r = rare();
+            r.onResize = hook;
+            r.onResizeContext = context;
+        }
+
+        /**
+         *  @brief  May rehash the %hash_map.
+         *  @param  n The new number of buckets.
+         *
+         *  @a n is rounded up by the capacity policy. Rehash will occur only
+         *  if the new number of buckets respect the %hash_map maximum load
+         *  factor for the elements present; tombstones are dropped.
+         *  Rehashing also takes over the elements of both tables of an
+         *  incremental rehash in progress. An empty %hash_map asked for 0
+         *  buckets releases its table and allocates nothing until the next
+         *  insert.
+         *
+         *  Elements are relocated straight from the old slots into the new
+         *  ones by move (or memcpy for trivially copyable pairs); nothing is
+         *  copied and no temporary container is allocated.
+         */
+        void rehash(size_type n) {
+            if (n == 0 && empty()) {
+                if (ownsBlock(current()) || draining()) releaseTables();
+                return;
+            }
+            n = Policy::capacity(n);
+            if (static_cast<float>(size()) / n > max_load_factor()) return; // Проверка на малое кол-во бакетов.
+            auto began = resizeStart();
+            size_type tombstones = _deletedElementCount;
+            _rehashes++;
+            table from = current();
+            table old = oldTable();
+            table to = newTable(n);
+
+            if (_rare) _rare->old = table{nullptr, nullptr, 0, nullptr};
+            setCurrent(to);
+            _deletedElementCount = 0;
+
+            transfer(from);
+            release(from);
+            if (old.ctrl) {
+                transfer(old);
+                release(old);
+            }
+            reportResize(from.capacity, tombstones, began);
+        }
+
+        /**
+         *  @brief  Prepare the %hash_map for a specified number of
+         *          elements.
+         *  @param  n Number of elements required.
+         *
+         *  Same as rehash(ceil(n / max_load_factor())).
+         */
+        void reserve(size_type n) {
+            rehash(ceil(n / max_load_factor()));
+        }
+
+        bool operator==(const hash_map& other) const {
+            if (size() != other.size()) return false;
+
+            for(auto& i : other) {
+                auto tmp = find(i.first);
+                if (tmp == end()) return false;
+                if (tmp->second != i.second) return false;
+            }
+
+            return true;
+        }
+
+        ~hash_map() {
+            destroy();
+        }
+
+    private:
         hash_map(size_type n, const allocator_type& a) :
                 _allocator(a),
-                _data(_allocator.allocate(n)),
-                _cellsState(new cellState[n]),
                 _loadFactor(0.75),
                 _elementCount(0),
-                _deletedElementCount(0),
-                _bucketCount(n) {}
+                _deletedElementCount(0) {
+            setCurrent(n == 0 ? emptyTable() : newTable(Policy::capacity(n)));
+        }
 
         void destroy() {
-            clear();
-            _allocator.deallocate(_data, bucket_count());
-            delete[]_cellsState;
+            destroyAll();
+            release(current());
         }
 
-        mapped_type& common_at(const key_type& k) {
-            iterator iter = find(k);
-            if(iter == end()) {
-                throw std::out_of_range("item not found");
+        // Destroys every element and frees the table being drained, if any.
+        void destroyAll() {
+            destroyElements(current());
+            if (draining()) {
+                destroyElements(_rare->old);
+                releaseOld();
             }
-            return (iter->second);
         }
 
-        template <typename... _Args>
-        std::pair<iterator, bool> common_try_emplace(key_type&& k, _Args&&... args) {
-            auto iter = find(k);
-            if(iter != end()) return std::make_pair(iter, false);
+        table current() const {
+            return table{_data, _ctrl, _bucketCount, _data ? hashesArray(reinterpret_cast<unsigned char*>(_ctrl), _bucketCount, HashStorage()) : nullptr};
+        }
 
-            return emplace(std::piecewise_construct,
-                           std::forward_as_tuple(std::move(k)),
-                           std::forward_as_tuple(std::forward<_Args>(args)...));
+        // The table of a map that has not allocated yet. Its one slot stays
+        // empty: the first insert always grows the map.
+        static table emptyTable() noexcept {
+            return table{nullptr, emptyGroup(), 1, nullptr};
         }
 
-        template <typename _Obj>
-        std::pair<iterator, bool> common_insert_or_assign(key_type&& k, _Obj&& obj){
-            auto res = insert(value_type{std::move(k), obj});
-            if (!res.second) {
-                res.first->second = std::forward<_Obj>(obj);
+        static bool ownsBlock(const table& t) noexcept {
+            return t.ctrl && t.ctrl != emptyGroup();
+        }
+
+        void setCurrent(const table& t) {
+            _data = t.data;
+            _ctrl = t.ctrl;
+            _bucketCount = t.capacity;
+        }
+
+        rare_state& rare() {
+            if (!_rare) _rare.reset(new rare_state());
+            return *_rare;
+        }
+
+        // Whether an incremental rehash is still draining an old table.
+        bool draining() const {
+            return _rare && _rare->old.ctrl;
+        }
+
+        table oldTable() const {
+            return _rare ? _rare->old : table{nullptr, nullptr, 0, nullptr};
+        }
+
+        // The same position, walk and all, as a mutable iterator.
+        static iterator mutableIterator(const const_iterator& it) {
+            return iterator(const_cast<value_type*>(it._x), it._xIndex, it._ctrl, it._mapSize, it._start,
+                            const_cast<value_type*>(it._nextX), it._nextCtrl, it._nextSize, it._nextStart);
+        }
+
+        /*
+         * Slot iteration over t begins at. Robin Hood iteration begins at an
+         * empty slot or at an element in its home slot: a backward shift
+         * never moves anything across either, so erasing as one iterates
+         * only ever pulls in elements the walk has not reached yet.
+         */
+        size_type walkStart(const table& t) const {
+            return walkStart(t, Probing());
+        }
+
+        static size_type walkStart(const table&, group_probing) {
+            return 0;
+        }
+
+        static size_type walkStart(const table& t, robin_hood_probing) {
+            size_type index = 0;
+            while (index < t.capacity && t.ctrl[index] > distanceByte(0)) index++;
+            return index == t.capacity ? 0 : index;
+        }
+
+        // The table an iterator with these control bytes walks.
+        table tableOf(const ctrl_t* ctrl) const {
+            return draining() && ctrl == _rare->old.ctrl ? _rare->old : current();
+        }
+
+        iterator iteratorAt(const table& t, size_type index) {
+            if (t.ctrl == _ctrl)
+                return iterator(_data, index, _ctrl, bucket_count(), walkStart(t));
+            return iterator(t.data, index, t.ctrl, t.capacity, walkStart(t),
+                              _data, _ctrl, bucket_count(), walkStart(current()));
+        }
+
+        const_iterator iteratorAt(const table& t, size_type index) const {
+            if (t.ctrl == _ctrl)
+                return const_iterator(_data, index, _ctrl, bucket_count(), walkStart(t));
+            return const_iterator(t.data, index, t.ctrl, t.capacity, walkStart(t),
+                                    _data, _ctrl, bucket_count(), walkStart(current()));
+        }
+
+        /*
+         * Looks k up in the current table and then in the one being drained.
+         * On a hit t is the table holding k; otherwise t is the current table
+         * and t.capacity is returned.
+         */
+        template<typename _Kt>
+        size_type locate(table& t, const _Kt& k, size_t hash) const {
+            size_type index = findIndex(t, k, hash, Probing());
+            if (index == t.capacity && draining()) {
+                size_type oldIndex = findIndex(_rare->old, k, hash, Probing());
+                if (oldIndex != _rare->old.capacity) {
+                    t = _rare->old;
+                    return oldIndex;
+                }
+            }
+            return index;
+        }
+
+        // Calls emit(t, index) with the locate() result of every key.
+        template<typename ForwardIt, typename F>
+        void batchLocate(ForwardIt first, ForwardIt last, F&& emit) const {
+            size_t hashes[batch_window];
+            while (first != last) {
+                ForwardIt window = first;
+                size_type n = 0;
+                table t = current();
+                for (; n < batch_window && first != last; ++n, ++first) {
+                    hashes[n] = hashFun(*first);
+                    size_type home = homeIndex(t, hashes[n]);
+                    prefetch(t.ctrl + home);
+                    prefetch(t.data + home);
+                }
+                for (size_type i = 0; i < n; ++i, ++window) {
+                    t = current();
+                    size_type index = locate(t, *window, hashes[i]);
+                    emit(t, index);
+                }
+            }
+        }
+
+        // Probes past its home the element of a busy slot sits.
+        size_type probeDistance(const table& t, size_type index, group_probing) const {
+            size_type home = homeIndex(t, slotHash(t, index));
+            return (index + t.capacity - home) % t.capacity / group::width;
+        }
+
+        size_type probeDistance(const table& t, size_type index, robin_hood_probing) const {
+            return slotDistance(t, index);
+        }
+
+        // Probes a miss starting at home takes.
+        size_type missProbes(const table& t, size_type, size_type emptyDistance, group_probing) const {
+            size_type groups = (t.capacity + group::width - 1) / group::width;
+            size_type res = emptyDistance / group::width + 1;
+            return res < groups ? res : groups;
+        }
+
+        size_type missProbes(const table& t, size_type home, size_type, robin_hood_probing) const {
+            size_type res = 1;
+            for (size_type distance = 0; t.ctrl[home] >= distanceByte(distance); distance++) {
+                home = nextIndex(t, home);
+                res++;
             }
             return res;
         }
 
-        std::pair<iterator, bool> common_insert(value_type&& x){
-            auto iter = find(x.first);
-            if (iter != end())
-                return std::pair<iterator, bool>(iter, false);
+        // Adds the layout of t to res; hitProbes sums the probes of hits.
+        void scanTable(const table& t, table_stats& res, size_type& hitProbes) const {
+            if (ownsBlock(t)) res.memory_bytes += blockSize(t.capacity) * sizeof(block_unit);
 
-            size_type index = bucketEmptyCell(x.first);
-            if(_cellsState[index] == _freed)
-                _deletedElementCount--;
+            for (size_type i = 0; i < t.capacity; i++) {
+                if (!isBusy(t.ctrl[i])) continue;
+                size_type d = probeDistance(t, i, Probing());
+                if (res.probe_lengths.size() <= d) res.probe_lengths.resize(d + 1);
+                res.probe_lengths[d]++;
+                hitProbes += d + 1;
+            }
 
-            new(_data + index) value_type{std::move(x)};
-            _cellsState[index] = _busy;
-            _elementCount++;
-            if (load_factor() > _loadFactor) {
-                rehash(bucket_count() * 2);
-                std::cout << "need to resize" << std::endl;
+            // Walking backwards twice around the table gives every slot the
+            // distance to the next empty one, wrapping included.
+            size_type toEmpty = t.capacity;
+            size_type run = 0;
+            size_type missTotal = 0;
+            for (size_type k = 2 * t.capacity; k-- > 0;) {
+                size_type i = k % t.capacity;
+                if (t.ctrl[i] == _empty) {
+                    toEmpty = 0;
+                    run = 0;
+                } else {
+                    if (toEmpty < t.capacity) toEmpty++;
+                    if (run < t.capacity) run++;
+                }
+                if (run > res.longest_cluster) res.longest_cluster = run;
+                if (k < t.capacity) missTotal += missProbes(t, i, toEmpty, Probing());
+            }
+            res.expected_miss_probes += static_cast<double>(missTotal) / t.capacity;
+        }
+
+        void destroyElements(const table& t) {
+            for (size_type i = findNextBusy(t.ctrl, 0, t.capacity); i < t.capacity;
+                 i = findNextBusy(t.ctrl, i + 1, t.capacity)) {
+                t.data[i].~value_type();
+            }
+        }
+
+        void release(const table& t) {
+            if (!ownsBlock(t)) return;
+            block_allocator blockAlloc(_allocator);
+            std::allocator_traits<block_allocator>::deallocate(
+                    blockAlloc, reinterpret_cast<block_unit*>(t.ctrl), blockSize(t.capacity));
+        }
+
+        void releaseOld() {
+            if (!_rare) return;
+            release(_rare->old);
+            _rare->old = table{nullptr, nullptr, 0, nullptr};
+        }
+
+        // Frees the tables of an empty map and puts it back on the empty group.
+        void releaseTables() {
+            auto began = resizeStart();
+            size_type oldCapacity = bucket_count();
+            size_type tombstones = _deletedElementCount;
+            _rehashes++;
+            releaseOld();
+            release(current());
+            setCurrent(emptyTable());
+            _deletedElementCount = 0;
+            reportResize(oldCapacity, tombstones, began);
+        }
+
+        // Relocates every element of from, which is no longer a table of
+        // the map, into the current table.
+        void transfer(const table& from) {
+            for (size_type i = findNextBusy(from.ctrl, 0, from.capacity); i < from.capacity;
+                 i = findNextBusy(from.ctrl, i + 1, from.capacity)) {
+                size_type to = prepareSlot(current(), slotHash(from, i), Probing());
+                relocate(_data + to, from.data + i);
+            }
+        }
+
+        /*
+         * Swaps in an empty table of n slots and starts draining the current
+         * one. Slots are moved from the back of a run towards its front, so
+         * a Robin Hood erase of a drained slot never has to shift anything.
+         */
+        void beginIncrementalRehash(size_type n) {
+            migrate(std::numeric_limits<size_type>::max());
+
+            auto began = resizeStart();
+            size_type tombstones = _deletedElementCount;
+            _rehashes++;
+            table to = newTable(Policy::capacity(n));
+            rare_state& r = rare();
+            r.old = current();
+            setCurrent(to);
+            _deletedElementCount = 0;
+
+            size_type start = 0;
+            while (start < r.old.capacity && r.old.ctrl[start] != _empty) start++;
+            r.migratePos = prevIndex(r.old, start % r.old.capacity);
+            r.migrateLeft = r.old.capacity;
+            reportResize(r.old.capacity, tombstones, began);
+        }
+
+        std::chrono::steady_clock::time_point resizeStart() const {
+            return _rare && _rare->onResize ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        }
+
+        void reportResize(size_type oldCapacity, size_type tombstones,
+                          std::chrono::steady_clock::time_point began) const {
+            if (!_rare || !_rare->onResize) return;
+            auto elapsed = std::chrono::steady_clock::now() - began;
+            _rare->onResize(resize_event{oldCapacity, bucket_count(), size(), tombstones,
+                                         static_cast<std::uint64_t>(
+                                                 std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count())},
+                            _rare->onResizeContext);
+        }
+
+        // Moves up to steps slots of the old table into the current one.
+        void migrate(size_type steps) {
+            if (!_rare) return;
+            rare_state& r = *_rare;
+            for (; steps > 0 && r.old.ctrl; steps--) {
+                if (r.migrateLeft == 0) {
+                    releaseOld();
+                    return;
+                }
+
+                size_type index = r.migratePos;
+                if (isBusy(r.old.ctrl[index])) {
+                    size_type to = prepareSlot(current(), slotHash(r.old, index), Probing());
+                    relocate(_data + to, r.old.data + index);
+                    freeSlot(r.old, index, Probing());
+                }
+                r.migratePos = prevIndex(r.old, index);
+                r.migrateLeft--;
+            }
+
+            if (r.old.ctrl && r.migrateLeft == 0) releaseOld();
+        }
+
+        /*
+         * Same-capacity rehash in place: live elements are marked _freed and
+         * old tombstones _empty, then every marked element goes to the first
+         * free slot of its probe sequence. It stays put if that slot is in
+         * the group it already sits in; a still-marked element in the target
+         * slot is swapped out and placed next.
+         */
+        void purgeTombstones() {
+            auto began = resizeStart();
+            size_type tombstones = _deletedElementCount;
+            _rehashes++;
+            table t = current();
+
+            for (size_type i = 0; i < t.capacity; i++)
+                t.ctrl[i] = isBusy(t.ctrl[i]) ? static_cast<ctrl_t>(_freed) : static_cast<ctrl_t>(_empty);
+            // Tables smaller than a group repeat their bytes more than once.
+            for (size_type i = t.capacity; i < ctrlSize(t.capacity); i++)
+                t.ctrl[i] = t.ctrl[i - t.capacity];
+
+            for (size_type i = 0; i < t.capacity; i++) {
+                if (t.ctrl[i] != _freed) continue;
+
+                size_t hash = slotHash(t, i);
+                size_type home = homeIndex(t, hash);
+                size_type to = bucketEmptyCell(t, hash, group_probing());
+                if ((i + t.capacity - home) % t.capacity / group::width ==
+                    (to + t.capacity - home) % t.capacity / group::width) {
+                    setCtrl(t, i, fingerprint(hash));
+                } else if (t.ctrl[to] == _empty) {
+                    relocate(t.data + to, t.data + i);
+                    storeHash(t, to, hash, HashStorage());
+                    setCtrl(t, to, fingerprint(hash));
+                    setCtrl(t, i, _empty);
+                } else {
+                    typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type tmp;
+                    value_type* displaced = reinterpret_cast<value_type*>(&tmp);
+                    relocate(displaced, t.data + to);
+                    relocate(t.data + to, t.data + i);
+                    relocate(t.data + i, displaced);
+                    moveHash(t, i, to, HashStorage());
+                    storeHash(t, to, hash, HashStorage());
+                    setCtrl(t, to, fingerprint(hash));
+                    i--;
+                }
+            }
+
+            _deletedElementCount = 0;
+            reportResize(t.capacity, tombstones, began);
+        }
+
+        void grow() {
+            if (_rare) _rare->grownAt = size();
+            if (!_data) {
+                rehash(Policy::capacity(firstCapacity));
+            } else if (incremental_rehash()) {
+                beginIncrementalRehash(Policy::grow(bucket_count()));
+            } else {
+                rehash(Policy::grow(bucket_count()));
+            }
+        }
+
+        /*
+         * The first group::width - 1 control bytes are mirrored past the end
+         * of the table, so a group load starting at any slot never needs to
+         * wrap around.
+         */
+        static size_type ctrlSize(size_type n) {
+            return n + group::width - 1;
+        }
+
+        // Offsets into a table block of n slots.
+        static size_type slotsOffset(size_type n) {
+            return (ctrlSize(n) + blockAlign - 1) / blockAlign * blockAlign;
+        }
+
+        static size_type hashesOffset(size_type n) {
+            return (slotsOffset(n) + n * sizeof(value_type) + alignof(size_t) - 1) / alignof(size_t) * alignof(size_t);
+        }
+
+        // Cache lines in a table block of n slots.
+        static size_type blockSize(size_type n) {
+            return (hashesOffset(n) + hashesSize(n, HashStorage()) + blockAlign - 1) / blockAlign;
+        }
+
+        static size_type hashesSize(size_type n, stored_hash) {
+            return n * sizeof(size_t);
+        }
+
+        static size_type hashesSize(size_type, no_stored_hash) {
+            return 0;
+        }
+
+        // An empty table of n slots in one block.
+        table newTable(size_type n) {
+            block_allocator blockAlloc(_allocator);
+            auto* block = reinterpret_cast<unsigned char*>(
+                    std::allocator_traits<block_allocator>::allocate(blockAlloc, blockSize(n)));
+            auto* ctrl = reinterpret_cast<ctrl_t*>(block);
+            std::memset(ctrl, _empty, ctrlSize(n));
+            return table{reinterpret_cast<value_type*>(block + slotsOffset(n)), ctrl, n,
+                         hashesArray(block, n, HashStorage())};
+        }
+
+        static size_t* hashesArray(unsigned char* block, size_type n, stored_hash) {
+            return reinterpret_cast<size_t*>(block + hashesOffset(n));
+        }
+
+        static size_t* hashesArray(unsigned char*, size_type, no_stored_hash) {
+            return nullptr;
+        }
+
+        // Hash of the element in a busy slot.
+        size_t slotHash(const table& t, size_type index) const {
+            return slotHash(t, index, HashStorage());
+        }
+
+        size_t slotHash(const table& t, size_type index, stored_hash) const {
+            return t.hashes[index];
+        }
+
+        size_t slotHash(const table& t, size_type index, no_stored_hash) const {
+            return hashFun(t.data[index].first);
+        }
+
+        // Whether the element in a busy slot can have this hash.
+        static bool hashMatches(const table& t, size_type index, size_t hash) {
+            return hashMatches(t, index, hash, HashStorage());
+        }
+
+        static bool hashMatches(const table& t, size_type index, size_t hash, stored_hash) {
+            return t.hashes[index] == hash;
+        }
+
+        static bool hashMatches(const table&, size_type, size_t, no_stored_hash) {
+            return true;
+        }
+
+        static void storeHash(const table& t, size_type index, size_t hash, stored_hash) {
+            t.hashes[index] = hash;
+        }
+
+        static void storeHash(const table&, size_type, size_t, no_stored_hash) {}
+
+        static void moveHash(const table& t, size_type to, size_type from, stored_hash) {
+            t.hashes[to] = t.hashes[from];
+        }
+
+        static void moveHash(const table&, size_type, size_type, no_stored_hash) {}
+
+        static void setCtrl(const table& t, size_type index, ctrl_t c) {
+            t.ctrl[index] = c;
+            for (size_type i = index + t.capacity; i < ctrlSize(t.capacity); i += t.capacity)
+                t.ctrl[i] = c;
+        }
+
+        // Moves the element at from into the raw slot at to.
+        static void relocate(value_type* to, value_type* from) {
+            relocate(to, from, std::integral_constant<bool,
+                    std::is_trivially_copy_constructible<value_type>::value &&
+                    std::is_trivially_destructible<value_type>::value>());
+        }
+
+        static void relocate(value_type* to, value_type* from, std::true_type) {
+            std::memcpy(static_cast<void*>(to), static_cast<const void*>(from), sizeof(value_type));
+        }
+
+        /*
+         * value_type's move constructor would copy the const key. The source
+         * is destroyed right after, so the key is moved out of it instead,
+         * as node handle extraction does in the standard containers.
+         */
+        static void relocate(value_type* to, value_type* from, std::false_type) {
+            new(to) value_type(std::move(const_cast<key_type&>(from->first)), std::move(from->second));
+            from->~value_type();
+        }
+
+        static size_type nextIndex(const table& t, size_type index) {
+            return Policy::index(index + 1, t.capacity);
+        }
+
+        static size_type prevIndex(const table& t, size_type index) {
+            return (index == 0 ? t.capacity : index) - 1;
+        }
+
+        // Nothing moves on erase, so last stays valid throughout.
+        iterator eraseRange(const_iterator first, const_iterator last, group_probing) {
+            while (first != last) first = erase(first);
+            return mutableIterator(last);
+        }
+
+        /*
+         * Backward shift may pull the element at last into the slot just
+         * freed, so the range is measured up front and erased by count.
+         */
+        iterator eraseRange(const_iterator first, const_iterator last, robin_hood_probing) {
+            auto n = std::distance(first, last);
+            iterator res = mutableIterator(last);
+            for (; n > 0; n--) first = res = erase(first);
+            return res;
+        }
+
+        // A walk like iteration's, so shifted elements are still checked once.
+        template<typename Predicate>
+        size_type eraseIf(const table& t, Predicate& pred) {
+            size_type erased = 0;
+            size_type start = walkStart(t);
+            size_type index = findNextInWalk(t.ctrl, static_cast<size_type>(-1), start, t.capacity);
+            while (index != t.capacity) {
+                if (pred(t.data[index])) {
+                    erased++;
+                    eraseAt(t, index);
+                    // Check the successor shifted back into this slot.
+                    if (isBusy(t.ctrl[index])) continue;
+                }
+                index = findNextInWalk(t.ctrl, index, start, t.capacity);
+            }
+            return erased;
+        }
+
+        void eraseAt(const table& t, size_type index) {
+            t.data[index].~value_type();
+            _elementCount--;
+            freeSlot(t, index, Probing());
+        }
+
+        /*
+         * A slot may go straight back to _empty if every group that covers it
+         * also covers an empty slot: any probe reaching it would have stopped
+         * in that group anyway. Otherwise it becomes a _freed tombstone.
+         */
+        void freeSlot(const table& t, size_type index, group_probing) {
+            if (t.capacity >= static_cast<size_type>(group::width)) {
+                size_type before = Policy::index(index + t.capacity - group::width, t.capacity);
+                auto emptyBefore = group(t.ctrl + before).matchEmpty();
+                auto emptyAfter = group(t.ctrl + index).matchEmpty();
+                if (emptyBefore && emptyAfter &&
+                    emptyAfter.trailingZeros() + emptyBefore.leadingZeros() < group::width) {
+                    setCtrl(t, index, _empty);
+                    return;
+                }
+            }
+
+            setCtrl(t, index, _freed);
+            // Tombstones of a table being drained go away with it.
+            if (t.ctrl == _ctrl) _deletedElementCount++;
+        }
+
+        // Backward shift: pull the rest of the run one slot closer to home.
+        void freeSlot(const table& t, size_type index, robin_hood_probing) {
+            for (size_type next = nextIndex(t, index); t.ctrl[next] > 0; next = nextIndex(t, next)) {
+                ctrl_t distance = distanceByte(slotDistance(t, next) - 1);
+                relocate(t.data + index, t.data + next);
+                moveHash(t, index, next, HashStorage());
+                setCtrl(t, index, distance);
+                index = next;
+            }
+            setCtrl(t, index, _empty);
+        }
+
+        template<typename _Kt>
+        mapped_type& common_at(const _Kt& k) const {
+            table t = current();
+            size_type index = locate(t, k, hashFun(k));
+            if(index == t.capacity) {
+                throw std::out_of_range("item not found");
+            }
+            return t.data[index].second;
+        }
+
+        template<typename _Kt>
+        size_type common_erase(const _Kt& x, size_t hash) {
+            table t = current();
+            size_type index = locate(t, x, hash);
+            if (index == t.capacity) return 0;
+            eraseAt(t, index);
+            return 1;
+        }
+
+        template<typename _Kt>
+        size_type common_bucket(const _Kt& k) const {
+            size_t hash = hashFun(k);
+            size_type index = findIndex(current(), k, hash, Probing());
+            return index != bucket_count() ? index : bucketEmptyCell(current(), hash, Probing());
+        }
+
+        template <typename _Kt, typename... _Args>
+        std::pair<iterator, bool> common_try_emplace(_Kt&& k, _Args&&... args) {
+            size_t hash = hashFun(k);
+            return findOrEmplace(k, hash, std::piecewise_construct,
+                                 std::forward_as_tuple(std::forward<_Kt>(k)),
+                                 std::forward_as_tuple(std::forward<_Args>(args)...));
+        }
+
+        // obj is only consumed by one of the two branches.
+        template <typename _Kt, typename _Obj>
+        std::pair<iterator, bool> common_insert_or_assign(_Kt&& k, _Obj&& obj, size_t hash){
+            auto res = findOrEmplace(k, hash, std::forward<_Kt>(k), std::forward<_Obj>(obj));
+            if (!res.second) res.first->second = std::forward<_Obj>(obj);
+            return res;
+        }
+
+        template <typename _Vt>
+        std::pair<iterator, bool> common_insert(_Vt&& x, size_t hash){
+            return findOrEmplace(x.first, hash, std::forward<_Vt>(x));
+        }
+
+        template <typename _Kt>
+        using is_key = std::is_same<typename std::decay<_Kt>::type, key_type>;
+
+        // A key and a value: the key can be looked up before anything is built.
+        template <typename _Kt, typename _Vt>
+        typename std::enable_if<is_key<_Kt>::value, std::pair<iterator, bool>>::type
+        common_emplace(_Kt&& k, _Vt&& v) {
+            size_t hash = hashFun(k);
+            return findOrEmplace(k, hash, std::forward<_Kt>(k), std::forward<_Vt>(v));
+        }
+
+        template <typename _Pair>
+        typename std::enable_if<is_key<decltype(std::declval<_Pair&>().first)>::value, std::pair<iterator, bool>>::type
+        common_emplace(_Pair&& x) {
+            return common_insert(std::forward<_Pair>(x), hashFun(x.first));
+        }
+
+        // Anything else has to be built to learn its key.
+        template <typename... _Args>
+        std::pair<iterator, bool> common_emplace(_Args&&... args) {
+            value_type x(std::forward<_Args>(args)...);
+            return common_insert(std::move(x), hashFun(x.first));
+        }
+
+        // An element built outside the table, relocated into its slot once
+        // the table is ready for it.
+        struct detached_element {
+            typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+            bool live = false;
+
+            template <typename... _Args>
+            explicit detached_element(_Args&&... args) {
+                new(&storage) value_type(std::forward<_Args>(args)...);
+                live = true;
+            }
+
+            detached_element(const detached_element&) = delete;
+            detached_element& operator=(const detached_element&) = delete;
+
+            ~detached_element() {
+                if (live) value()->~value_type();
+            }
+
+            value_type* value() {
+                return reinterpret_cast<value_type*>(&storage);
+            }
+        };
+
+        /*
+         * Looks k up by its mixed hash and, if it is absent, builds
+         * value_type(args...) in a slot of the current table; args are only
+         * used in that case. The probe for k also finds the slot k would go
+         * in, and the element is built right there. If the table has to be
+         * resized or drained first, or claiming the slot shifts a Robin Hood
+         * run, elements move before the new one exists, and args may refer
+         * to one of them: the element is then built off the table first and
+         * relocated in afterwards.
+         */
+        template <typename _Kt, typename... _Args>
+        std::pair<iterator, bool> findOrEmplace(const _Kt& k, size_t hash, _Args&&... args) {
+            table t = current();
+            size_type slot;
+            size_type index = findIndex(t, k, hash, slot, Probing());
+            if (index == t.capacity && draining()) {
+                size_type oldIndex = findIndex(_rare->old, k, hash, Probing());
+                if (oldIndex != _rare->old.capacity)
+                    return std::pair<iterator, bool>(iteratorAt(_rare->old, oldIndex), false);
             }
-            return std::pair<iterator, bool>(hash_map_iterator<value_type>(_data, index, _cellsState, _bucketCount), true);
+            if (index != t.capacity)
+                return std::pair<iterator, bool>(iteratorAt(t, index), false);
+
+            // Resize before placing the element so the returned iterator
+            // stays valid. Moving elements around invalidates slot.
+            bool resize = shrinkNeeded() || growthNeeded() || draining();
+            if (!empty() && (resize || claimMoves(t, slot, Probing()))) {
+                detached_element x(std::forward<_Args>(args)...);
+                if (resize) {
+                    makeRoomForInsert();
+                    slot = t.capacity;
+                }
+                index = placeNew(t, slot, hash);
+                relocate(_data + index, x.value());
+                x.live = false;
+            } else {
+                if (resize) {
+                    makeRoomForInsert();
+                    slot = t.capacity;
+                }
+                index = placeNew(t, slot, hash);
+                try {
+                    new(_data + index) value_type(std::forward<_Args>(args)...);
+                } catch (...) {
+                    freeSlot(current(), index, Probing());
+                    throw;
+                }
+            }
+            _elementCount++;
+            return std::pair<iterator, bool>(hash_map_iterator<value_type>(_data, index, _ctrl, _bucketCount), true);
+        }
+
+        // Claims slot of t, or probes the current table if slot is t.capacity.
+        size_type placeNew(const table& t, size_type slot, size_t hash) {
+            return slot == t.capacity ? prepareSlot(current(), hash, Probing()) : claimSlot(t, slot, hash, Probing());
+        }
+
+        // Shrinks, grows, purges or drains as inserting a new key requires.
+        void makeRoomForInsert() {
+            if (shrinkNeeded()) shrink();
+            if (growthNeeded()) makeRoom();
+            migrate(rehashStep);
+        }
+
+        // Whether claimSlot() moves elements to free the slot.
+        static bool claimMoves(const table&, size_type, group_probing) {
+            return false;
+        }
+
+        static bool claimMoves(const table& t, size_type index, robin_hood_probing) {
+            return t.ctrl[index] != _empty;
         }
 
         size_type loadCells() const {
             return (_elementCount + _deletedElementCount);
         }
 
-        size_type hashFun(const key_type& k) const {
-            return (_hash(k) % bucket_count());
+        // Whether inserting a new key has to make room first. A map still
+        // on the empty group has no slot array, so it always has to.
+        bool growthNeeded() const {
+            return static_cast<float>(loadCells() + 1) / bucket_count() > _loadFactor || !_data;
+        }
+
+        /*
+         * Tombstones dominate once live elements fill at most half of the
+         * maximum load: purging them leaves room for as many inserts again
+         * as the table holds, so the O(capacity) purge stays amortized O(1).
+         */
+        bool tombstonesDominate() const {
+            return _deletedElementCount > 0 && !draining() &&
+                   static_cast<float>(_elementCount + 1) <= _loadFactor * bucket_count() / 2;
+        }
+
+        bool shrinkNeeded() const {
+            return min_load_factor() > 0 && size() < _rare->grownAt &&
+                   static_cast<float>(size()) < min_load_factor() * bucket_count() &&
+                   shrinkCapacity() < bucket_count();
+        }
+
+        // Capacity that puts the map, plus the element being inserted, at
+        // half the maximum load, but no less than a first table.
+        size_type shrinkCapacity() const {
+            size_type n = static_cast<size_type>(std::ceil((size() + 1) / (_loadFactor / 2)));
+            if (n < firstCapacity) n = firstCapacity;
+            return Policy::capacity(n);
         }
 
-        size_type findFirstBusyCell() const{
-            for (size_type i = 0; i < bucket_count(); i++) {
-                if(_cellsState[i] == _busy) return i;
+        void shrink() {
+            rehash(shrinkCapacity());
+        }
+
+        void makeRoom() {
+            if (tombstonesDominate()) {
+                purgeTombstones();
+            } else {
+                grow();
+            }
+        }
+
+        template<typename _Kt>
+        size_t hashFun(const _Kt& k) const {
+            return Policy::mix(_hash(k));
+        }
+
+        static size_type homeIndex(const table& t, size_t hash) {
+            return Policy::index(hash, t.capacity);
+        }
+
+        // Old slots moved per insert while an incremental rehash is running.
+        static constexpr size_type rehashStep = 32;
+
+        // Slots the first insert into a map without a table allocates.
+        static constexpr size_type firstCapacity = 16;
+
+        void countLookup() const {
+#ifdef FEFU_HASH_MAP_COUNTERS
+            _lookups.fetch_add(1, std::memory_order_relaxed);
+#endif
+        }
+
+        void countProbe() const {
+#ifdef FEFU_HASH_MAP_COUNTERS
+            _probes.fetch_add(1, std::memory_order_relaxed);
+#endif
+        }
+
+        static ctrl_t fingerprint(size_t hash) {
+            return static_cast<ctrl_t>(Policy::fingerprint(hash));
+        }
+
+        /*
+         * Probing walks the table one group of control bytes at a time,
+         * starting at the home slot: fingerprint matches are the only slots
+         * whose keys get compared, and a group holding an empty slot ends
+         * the sequence.
+         */
+
+        // Index of the slot of t holding k, or t.capacity if it is absent.
+        template<typename _Kt>
+        size_type findIndex(const table& t, const _Kt& k, size_t hash, group_probing) const {
+            ctrl_t h = fingerprint(hash);
+            size_type pos = homeIndex(t, hash);
+            countLookup();
+
+            for (size_type probed = 0; probed < t.capacity; probed += group::width) {
+                countProbe();
+                group g(t.ctrl + pos);
+                for (auto m = g.match(h); m; m.next()) {
+                    size_type index = Policy::index(pos + m.lowest(), t.capacity);
+                    if (hashMatches(t, index, hash) && _equal(k, t.data[index].first)) return index;
+                }
+                if (g.matchEmpty()) break;
+                pos = Policy::index(pos + group::width, t.capacity);
             }
-            return bucket_count();
+
+            return t.capacity;
+        }
+
+        // findIndex() that also reports in slot where bucketEmptyCell() would put k.
+        template<typename _Kt>
+        size_type findIndex(const table& t, const _Kt& k, size_t hash, size_type& slot, group_probing) const {
+            ctrl_t h = fingerprint(hash);
+            size_type pos = homeIndex(t, hash);
+            slot = t.capacity;
+            countLookup();
+
+            for (size_type probed = 0; probed < t.capacity; probed += group::width) {
+                countProbe();
+                group g(t.ctrl + pos);
+                for (auto m = g.match(h); m; m.next()) {
+                    size_type index = Policy::index(pos + m.lowest(), t.capacity);
+                    if (hashMatches(t, index, hash) && _equal(k, t.data[index].first)) return index;
+                }
+                if (slot == t.capacity) {
+                    auto free = g.matchNonBusy();
+                    if (free) slot = Policy::index(pos + free.lowest(), t.capacity);
+                }
+                if (g.matchEmpty()) break;
+                pos = Policy::index(pos + group::width, t.capacity);
+            }
+
+            return t.capacity;
+        }
+
+        // First empty or freed slot on the probe sequence of hash.
+        size_type bucketEmptyCell(const table& t, size_t hash, group_probing) const{
+            size_type pos = homeIndex(t, hash);
+
+            while (true) {
+                auto m = group(t.ctrl + pos).matchNonBusy();
+                if (m) return Policy::index(pos + m.lowest(), t.capacity);
+                pos = Policy::index(pos + group::width, t.capacity);
+            }
+        }
+
+        // Marks the slot returned by bucketEmptyCell() busy.
+        size_type prepareSlot(const table& t, size_t hash, group_probing) {
+            return claimSlot(t, bucketEmptyCell(t, hash, group_probing()), hash, group_probing());
+        }
+
+        size_type claimSlot(const table& t, size_type index, size_t hash, group_probing) {
+            if(t.ctrl[index] == _freed)
+                _deletedElementCount--;
+            setCtrl(t, index, fingerprint(hash));
+            storeHash(t, index, hash, HashStorage());
+            return index;
+        }
+
+        /*
+         * Robin Hood probing keeps every run ordered by home slot. A control
+         * byte holds the probe distance capped at maxDistance: elements of a
+         * degenerate hash that land further away all store maxDistance, so
+         * a probe past that distance degrades to plain linear probing up to
+         * the first poorer element or empty slot instead of growing the
+         * table. The real distance of a capped element is recomputed from
+         * its hash when a backward shift needs it.
+         */
+        static constexpr ctrl_t maxDistance = std::numeric_limits<ctrl_t>::max();
+
+        static ctrl_t distanceByte(size_type distance) {
+            return distance < static_cast<size_type>(maxDistance) ? static_cast<ctrl_t>(distance) : maxDistance;
+        }
+
+        // Uncapped probe distance of the element in a busy slot.
+        size_type slotDistance(const table& t, size_type index) const {
+            if (t.ctrl[index] < maxDistance) return static_cast<size_type>(t.ctrl[index]);
+            return (index + t.capacity - homeIndex(t, slotHash(t, index))) % t.capacity;
+        }
+
+        template<typename _Kt>
+        size_type findIndex(const table& t, const _Kt& k, size_t hash, robin_hood_probing) const {
+            size_type index = homeIndex(t, hash);
+            countLookup();
+
+            for (size_type distance = 0; countProbe(), t.ctrl[index] >= distanceByte(distance); distance++) {
+                if (t.ctrl[index] == distanceByte(distance) && hashMatches(t, index, hash) && _equal(k, t.data[index].first)) return index;
+                index = nextIndex(t, index);
+            }
+
+            return t.capacity;
+        }
+
+        // findIndex() that also reports in slot where prepareSlot() would put k.
+        template<typename _Kt>
+        size_type findIndex(const table& t, const _Kt& k, size_t hash, size_type& slot, robin_hood_probing) const {
+            size_type index = homeIndex(t, hash);
+            slot = t.capacity;
+            countLookup();
+
+            for (size_type distance = 0; countProbe(), t.ctrl[index] >= distanceByte(distance); distance++) {
+                if (t.ctrl[index] == distanceByte(distance) && hashMatches(t, index, hash) && _equal(k, t.data[index].first)) return index;
+                index = nextIndex(t, index);
+            }
+
+            slot = index;
+            return t.capacity;
+        }
+
+        // First slot whose element is closer to its home than we would be.
+        size_type bucketEmptyCell(const table& t, size_t hash, robin_hood_probing) const {
+            size_type index = homeIndex(t, hash);
+
+            for (size_type distance = 0; t.ctrl[index] >= distanceByte(distance); distance++) {
+                index = nextIndex(t, index);
+            }
+
+            return index;
+        }
+
+        size_type prepareSlot(const table& t, size_t hash, robin_hood_probing) {
+            return claimSlot(t, bucketEmptyCell(t, hash, robin_hood_probing()), hash, robin_hood_probing());
         }
 
-        size_type bucketEmptyCell(const key_type& _K) const{
-            size_type index = hashFun(_K);
+        // Takes the slot from a richer element and shifts the run behind it.
+        size_type claimSlot(const table& t, size_type index, size_t hash, robin_hood_probing) {
+            ctrl_t distance = distanceByte((index + t.capacity - homeIndex(t, hash)) % t.capacity);
+            size_type last = index;
+            while (t.ctrl[last] != _empty) last = nextIndex(t, last);
 
-            while (!_equal(_K, _data[index].first) &&
-                   (_cellsState[index] == _busy)) {
-                index = (index + 1) % bucket_count();
+            for (; last != index; last = prevIndex(t, last)) {
+                size_type prev = prevIndex(t, last);
+                relocate(t.data + last, t.data + prev);
+                moveHash(t, last, prev, HashStorage());
+                setCtrl(t, last, distanceByte(static_cast<size_type>(t.ctrl[prev]) + 1));
             }
 
+            setCtrl(t, index, distance);
+            storeHash(t, index, hash, HashStorage());
             return index;
         }
     };
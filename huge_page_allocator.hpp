@@ -0,0 +1,166 @@
+#pragma once
+
+#include "hash_map.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace fefu
+{
+    /// Size of a transparent huge page on x86-64 and most arm64 kernels.
+    constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+
+    // Shared by all copies of a huge_page_allocator, whatever they are
+    // rebound to; concurrent_hash_map shards update it from different
+    // threads.
+    struct huge_page_state {
+        explicit huge_page_state(std::size_t threshold) : threshold(threshold) {}
+
+        std::size_t threshold;
+        std::atomic<std::size_t> mapBytes{0};
+        std::atomic<bool> advised{false};
+    };
+
+    /**
+     *  Allocator for very large tables. Blocks of at least threshold() bytes
+     *  are mapped on their own, aligned to huge_page_size, and the kernel is
+     *  asked to back them with transparent huge pages (MADV_HUGEPAGE), so
+     *  random slot accesses miss the TLB far less often. Smaller blocks, and
+     *  every block on systems other than Linux, come from operator new.
+     *
+     *  Copies and rebound copies share the threshold and the counters, so
+     *  hash_map::get_allocator().huge_pages() tells whether the map's table
+     *  got the advice. A kernel without transparent huge pages refuses
+     *  madvise(); the block then stays an ordinary mapping. A failed mmap()
+     *  throws std::bad_alloc like operator new.
+     */
+    template<typename T>
+    class huge_page_allocator {
+    public:
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using const_pointer = const T*;
+        using value_type = T;
+
+        explicit huge_page_allocator(size_type threshold = huge_page_size) :
+                _state(std::make_shared<huge_page_state>(threshold)) {}
+
+        template <class U>
+        huge_page_allocator(const huge_page_allocator<U>& other) noexcept : _state(other._state) {}
+
+        pointer allocate(size_type n) {
+            if (n > std::numeric_limits<size_type>::max() / sizeof(value_type)) throw std::bad_array_new_length();
+            size_type bytes = n * sizeof(value_type);
+            if (mapped(bytes)) return static_cast<pointer>(mapHuge(bytes));
+            return allocator<value_type>().allocate(n);
+        }
+
+        void deallocate(pointer p, size_type n) noexcept {
+            size_type bytes = n * sizeof(value_type);
+            if (mapped(bytes)) {
+                unmapHuge(p, bytes);
+            } else {
+                allocator<value_type>().deallocate(p, n);
+            }
+        }
+
+        /// Bytes from which a block gets its own huge-page-aligned mapping.
+        size_type threshold() const noexcept {
+            return _state->threshold;
+        }
+
+        /// Whether the last block mapped on its own got MADV_HUGEPAGE. The
+        /// kernel's THP settings still decide whether it is backed by huge
+        /// pages; AnonHugePages in /proc/self/smaps shows how much is.
+        bool huge_pages() const noexcept {
+            return _state->advised.load(std::memory_order_relaxed);
+        }
+
+        /// Bytes of live blocks mapped on their own.
+        size_type mapped_bytes() const noexcept {
+            return _state->mapBytes.load(std::memory_order_relaxed);
+        }
+
+        template<typename U>
+        bool operator==(const huge_page_allocator<U>& other) const noexcept {
+            return _state == other._state;
+        }
+
+        template<typename U>
+        bool operator!=(const huge_page_allocator<U>& other) const noexcept {
+            return _state != other._state;
+        }
+
+    private:
+        template<typename>
+        friend class huge_page_allocator;
+
+        std::shared_ptr<huge_page_state> _state;
+
+        bool mapped(size_type bytes) const noexcept {
+#if defined(__linux__)
+            return bytes >= _state->threshold;
+#else
+            (void) bytes;
+            return false;
+#endif
+        }
+
+        static size_type mapSize(size_type bytes) noexcept {
+            return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+        }
+
+        /*
+         * Maps one huge page more than needed and unmaps the ends, leaving
+         * a block that starts on a huge page boundary.
+         */
+        void* mapHuge(size_type bytes) {
+#if defined(__linux__)
+            size_type size = mapSize(bytes);
+            if (size < bytes || size + huge_page_size < size) throw std::bad_alloc();
+            void* raw = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) throw std::bad_alloc();
+
+            auto start = reinterpret_cast<std::uintptr_t>(raw);
+            std::uintptr_t aligned = (start + huge_page_size - 1) & ~std::uintptr_t(huge_page_size - 1);
+            if (aligned > start) munmap(raw, aligned - start);
+            size_type tail = start + huge_page_size - aligned;
+            if (tail) munmap(reinterpret_cast<void*>(aligned + size), tail);
+
+            void* p = reinterpret_cast<void*>(aligned);
+            _state->mapBytes += size;
+#ifdef MADV_HUGEPAGE
+            _state->advised = madvise(p, size, MADV_HUGEPAGE) == 0;
+#else
+            _state->advised = false;
+#endif
+            return p;
+#else
+            (void) bytes;
+            throw std::bad_alloc();
+#endif
+        }
+
+        void unmapHuge(void* p, size_type bytes) noexcept {
+#if defined(__linux__)
+            size_type size = mapSize(bytes);
+            munmap(p, size);
+            _state->mapBytes -= size;
+#else
+            (void) p;
+            (void) bytes;
+#endif
+        }
+    };
+
+}
@@ -1,11 +1,123 @@
 #define CATCH_CONFIG_MAIN
 #include "hash_map.hpp"
+#include "concurrent_hash_map.hpp"
+#include "arena_allocator.hpp"
+#include "huge_page_allocator.hpp"
 #include "catch.hpp"
 #include <string>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <fstream>
 
 using namespace std;
 using namespace fefu; // :0
+
+struct counting_equal {
+    static size_t calls;
+    template<typename T>
+    bool operator()(const T& a, const T& b) const {
+        calls++;
+        return a == b;
+    }
+};
+size_t counting_equal::calls = 0;
+
+// Counts the string hashes a map computes.
+struct counting_hash {
+    static size_t calls;
+    size_t operator()(const string& s) const {
+        calls++;
+        return std::hash<string>()(s);
+    }
+};
+size_t counting_hash::calls = 0;
+
+// Counts the blocks a map allocates and those not aligned for their type.
+struct allocation_counter {
+    static size_t calls;
+    static size_t misaligned;
+};
+size_t allocation_counter::calls = 0;
+size_t allocation_counter::misaligned = 0;
+
+template<typename T>
+struct counting_allocator : fefu::allocator<T>, allocation_counter {
+    counting_allocator() = default;
+    template<class U>
+    counting_allocator(const counting_allocator<U>&) noexcept {}
+    T* allocate(size_t n) {
+        calls++;
+        T* p = fefu::allocator<T>::allocate(n);
+        if (reinterpret_cast<uintptr_t>(p) % alignof(T)) misaligned++;
+        return p;
+    }
+};
+
+struct tracked {
+    static size_t copies;
+    int value;
+    explicit tracked(int v) : value(v) {}
+    tracked(const tracked& other) : value(other.value) {
+        copies++;
+    }
+    tracked(tracked&& other) noexcept : value(other.value) {}
+    bool operator==(const tracked& other) const {
+        return value == other.value;
+    }
+};
+size_t tracked::copies = 0;
+
+struct tracked_hash {
+    size_t operator()(const tracked& t) const {
+        return std::hash<int>()(t.value);
+    }
+};
+
+// Looks tracked keys up by their int; tracked can't be built implicitly.
+struct tracked_id_hash : tracked_hash {
+    using is_transparent = void;
+    using tracked_hash::operator();
+    size_t operator()(int v) const {
+        return std::hash<int>()(v);
+    }
+};
+
+struct tracked_id_equal {
+    using is_transparent = void;
+    bool operator()(const tracked& a, const tracked& b) const {
+        return a == b;
+    }
+    bool operator()(int a, const tracked& b) const {
+        return a == b.value;
+    }
+};
+
+// Counts how often a mapped value is built and moved.
+struct counted {
+    static size_t built;
+    static size_t moves;
+    int value;
+    counted() : value(0) {
+        built++;
+    }
+    explicit counted(int v) : value(v) {
+        if (v < 0) throw std::invalid_argument("negative");
+        built++;
+    }
+    counted(const counted& other) : value(other.value) {
+        built++;
+    }
+    counted(counted&& other) noexcept : value(other.value) {
+        moves++;
+    }
+    counted& operator=(const counted&) = default;
+};
+size_t counted::built = 0;
+size_t counted::moves = 0;
+
 TEST_CASE("sanya.com") {
     SECTION("0000") {
         hash_map<char, string> map(10);
@@ -33,7 +145,7 @@ TEST_CASE("sanya.com") {
 
     SECTION("000") {
         hash_map<size_t, size_t> hash_map(10);
-        CHECK(hash_map.bucket_count() == 10);
+        CHECK(hash_map.bucket_count() == 16);
     }
 
     SECTION("0000") {
@@ -45,7 +157,18 @@ TEST_CASE("sanya.com") {
         }
         hash_map.max_load_factor(0.5);
         CHECK(hash_map.max_load_factor() == 0.5);
-        CHECK(hash_map.load_factor() == 0.3f);
+        CHECK(hash_map.load_factor() == 0.1875f);
+
+        // Copies keep the load factor.
+        auto copy = hash_map;
+        CHECK(copy.max_load_factor() == 0.5);
+        fefu::hash_map<size_t, size_t> assigned;
+        assigned = hash_map;
+        CHECK(assigned.max_load_factor() == 0.5);
+        for (size_t i = count; i < 100; i++) {
+            copy.insert({i, i});
+        }
+        CHECK(copy.load_factor() <= 0.5f);
     }
 
     SECTION("000") {
@@ -55,9 +178,12 @@ TEST_CASE("sanya.com") {
         hash_map.insert(std::pair<char, string>('2', "klj"));
 
         auto iterator = hash_map.begin();
-        CHECK("abc" == iterator->second);
-        CHECK("zxc" == iterator.operator++()->second);
-        CHECK("klj" == iterator.operator++()->second);
+        vector<string> values{iterator->second,
+                              iterator.operator++()->second,
+                              iterator.operator++()->second};
+        sort(values.begin(), values.end());
+        CHECK(values == vector<string>{"abc", "klj", "zxc"});
+        CHECK(++iterator == hash_map.end());
     }
 
     SECTION("000") {
@@ -142,5 +268,1117 @@ TEST_CASE("sanya.com") {
         CHECK(!res2.second);
         CHECK(hash_map[key] == 666);
     }
+
+    SECTION("fingerprints filter key comparisons") {
+        hash_map<string, int, std::hash<string>, counting_equal> map(512);
+        for (int i = 0; i < 200; i++) {
+            map.insert({to_string(i), i});
+        }
+
+        counting_equal::calls = 0;
+        for (int i = 0; i < 200; i++) {
+            CHECK(!map.contains("x" + to_string(i)));
+        }
+        CHECK(counting_equal::calls < 50);
+
+        counting_equal::calls = 0;
+        for (int i = 0; i < 200; i += 2) {
+            CHECK(map.erase(to_string(i)) == 1);
+        }
+        for (int i = 0; i < 200; i++) {
+            CHECK(map.contains(to_string(i)) == (i % 2 == 1));
+        }
+        CHECK(counting_equal::calls < 320);
+    }
+
+    SECTION("group probing with wraparound and tombstones") {
+        hash_map<int, int> map(3);
+        for (int i = 0; i < 1000; i++) {
+            map.insert({i, i * 2});
+        }
+        for (int i = 0; i < 1000; i += 3) {
+            CHECK(map.erase(i) == 1);
+        }
+        for (int i = 0; i < 1000; i++) {
+            REQUIRE(map.contains(i) == (i % 3 != 0));
+        }
+        for (int i = 0; i < 1000; i += 3) {
+            CHECK(map.insert({i, -i}).second);
+        }
+        CHECK(map.size() == 1000);
+        CHECK(map.at(3) == -3);
+        CHECK(map.at(4) == 8);
+
+        size_t visited = 0;
+        for (auto& i : map) {
+            visited++;
+            CHECK(i.second == (i.first % 3 == 0 ? -i.first : i.first * 2));
+        }
+        CHECK(visited == 1000);
+    }
+
+    SECTION("capacity policies") {
+        hash_map<int, int> pow2(100);
+        CHECK(pow2.bucket_count() == 128);
+        for (int i = 0; i < 100; i++) {
+            pow2.insert({i, i});
+        }
+        CHECK(pow2.bucket_count() == 256);
+
+        hash_map<int, int, std::hash<int>, std::equal_to<int>,
+                 fefu::allocator<pair<const int, int>>, prime_modulo_policy> prime(10);
+        CHECK(prime.bucket_count() == 13);
+        for (int i = 0; i < 100; i++) {
+            prime.insert({i * 13, i});
+        }
+        CHECK(prime.bucket_count() == 193);
+        for (int i = 0; i < 100; i++) {
+            CHECK(prime.at(i * 13) == i);
+        }
+
+        // std::hash<int> leaves the top bits clear; fingerprints must still
+        // tell keys apart.
+        hash_map<int, int, std::hash<int>, counting_equal,
+                 fefu::allocator<pair<const int, int>>, prime_modulo_policy> weak;
+        for (int i = 0; i < 1000; i++) {
+            weak.insert({i * 7, i});
+        }
+        counting_equal::calls = 0;
+        for (int i = 0; i < 1400; i++) {
+            REQUIRE(!weak.contains(1000000 + i * 7));
+        }
+        CHECK(counting_equal::calls < 300);
+
+        hash_map<int, int> empty(0);
+        CHECK(empty.bucket_count() == 1);
+        empty[1] = 1;
+        CHECK(empty.at(1) == 1);
+    }
+
+    SECTION("robin hood probing") {
+        robin_hood_hash_map<string, int> map(64);
+        for (int i = 0; i < 40; i++) {
+            map.insert({to_string(i), i});
+        }
+        size_t buckets = map.bucket_count();
+
+        // Churn never leaves tombstones, so the table doesn't grow.
+        for (int round = 0; round < 50; round++) {
+            for (int i = 0; i < 40; i += 2) {
+                REQUIRE(map.erase(to_string(i)) == 1);
+            }
+            for (int i = 0; i < 40; i += 2) {
+                REQUIRE(map.insert({to_string(i), i + round}).second);
+            }
+        }
+        CHECK(map.bucket_count() == buckets);
+        CHECK(map.load_factor() == 40.0f / buckets);
+
+        for (int i = 0; i < 40; i++) {
+            CHECK(map.at(to_string(i)) == (i % 2 ? i : i + 49));
+            CHECK(!map.contains("x" + to_string(i)));
+        }
+
+        for (auto it = map.begin(); it != map.end();) {
+            it = it->second % 3 == 0 ? map.erase(it) : ++it;
+        }
+        for (int i = 0; i < 40; i++) {
+            int value = i % 2 ? i : i + 49;
+            CHECK(map.contains(to_string(i)) == (value % 3 != 0));
+        }
+
+        // A run that wraps past the last slot: erasing in it shifts the
+        // front of the table back to the end, and iteration must still see
+        // every element exactly once.
+        robin_hood_hash_map<int, int> homes(64);
+        vector<int> keys;
+        for (int k = 0; keys.size() < 8; k++) {
+            if (homes.bucket(k) >= 61) keys.push_back(k);
+        }
+        for (int k = 0; keys.size() < 12; k++) {
+            if (homes.bucket(k) == 0) keys.push_back(k);
+        }
+        for (size_t skip = 1; skip <= 4; skip++) {
+            robin_hood_hash_map<int, int> wrap(64);
+            for (int k : keys) {
+                wrap[k] = k;
+            }
+            REQUIRE(wrap.bucket_count() == 64);
+            vector<int> visited;
+            size_t n = 0;
+            for (auto it = wrap.begin(); it != wrap.end();) {
+                visited.push_back(it->first);
+                it = n++ % skip == 0 ? wrap.erase(it) : ++it;
+            }
+            sort(visited.begin(), visited.end());
+            vector<int> expected = keys;
+            sort(expected.begin(), expected.end());
+            REQUIRE(visited == expected);
+        }
+
+        robin_hood_hash_map<int, int> ints(2);
+        for (int i = 0; i < 5000; i++) {
+            ints[i] = i;
+        }
+        for (int i = 0; i < 5000; i += 2) {
+            ints.erase(i);
+        }
+        CHECK(ints.size() == 2500);
+        for (int i = 0; i < 5000; i++) {
+            REQUIRE(ints.count(i) == size_t(i % 2));
+        }
+
+        // Merging erases from a Robin Hood source, which shifts elements back.
+        robin_hood_hash_map<int, int> source, target;
+        for (int i = 0; i < 40; i++) {
+            source[i] = i;
+        }
+        for (int i = 0; i < 10; i++) {
+            target[i] = -i;
+        }
+        target.merge(source);
+        CHECK(target.size() == 40);
+        CHECK(source.size() == 10);
+        for (int i = 0; i < 40; i++) {
+            REQUIRE(target.at(i) == (i < 10 ? -i : i));
+            REQUIRE(source.contains(i) == (i < 10));
+        }
+
+        // More keys share a home slot than a control byte can count; the
+        // runs past the cap are probed linearly instead of growing the table.
+        struct constant_hash {
+            size_t operator()(int) const {
+                return 0;
+            }
+        };
+        robin_hood_hash_map<int, int, constant_hash> same;
+        for (int i = 0; i < 300; i++) {
+            REQUIRE(same.insert({i, i}).second);
+        }
+        CHECK(same.size() == 300);
+        CHECK(same.bucket_count() == 512);
+        CHECK(same.stats().probe_lengths.size() == 300);
+        for (int i = 0; i < 300; i += 3) {
+            REQUIRE(same.erase(i) == 1);
+        }
+        for (int i = 0; i < 300; i++) {
+            REQUIRE(same.contains(i) == (i % 3 != 0));
+        }
+        CHECK(!same.contains(300));
+        same.incremental_rehash(true);
+        for (int i = 300; i < 600; i++) {
+            same[i] = i;
+        }
+        CHECK(same.size() == 500);
+        for (int i = 0; i < 600; i++) {
+            REQUIRE(same.count(i) == size_t(i < 300 ? i % 3 != 0 : 1));
+        }
+    }
+
+    SECTION("rehash relocates without copying") {
+        hash_map<tracked, tracked, tracked_hash> map(16);
+        for (int i = 0; i < 1000; i++) {
+            map.insert({tracked(i), tracked(-i)});
+        }
+
+        tracked::copies = 0;
+        map.rehash(8192);
+        map.reserve(20000);
+        CHECK(tracked::copies == 0);
+        CHECK(map.size() == 1000);
+        for (int i = 0; i < 1000; i++) {
+            REQUIRE(map.at(tracked(i)).value == -i);
+        }
+
+        robin_hood_hash_map<string, string> strings(4);
+        for (int i = 0; i < 1000; i++) {
+            strings.insert({to_string(i), string(40, 'a' + i % 26)});
+        }
+        strings.rehash(4096);
+        for (int i = 0; i < 1000; i++) {
+            REQUIRE(strings.at(to_string(i)) == string(40, 'a' + i % 26));
+        }
+    }
+
+    SECTION("incremental rehash") {
+        hash_map<int, int> map(1024);
+        map.incremental_rehash(true);
+        CHECK(map.incremental_rehash());
+        for (int i = 0; i < 769; i++) {
+            map.insert({i, i});
+        }
+        CHECK(map.bucket_count() == 2048);
+
+        // The old table is still being drained: everything stays reachable.
+        for (int i = 0; i < 769; i++) {
+            REQUIRE(map.at(i) == i);
+        }
+        size_t visited = 0;
+        for (auto it = map.cbegin(); it != map.cend(); ++it) {
+            visited++;
+        }
+        CHECK(visited == 769);
+
+        for (int i = 0; i < 769; i += 2) {
+            CHECK(map.erase(i) == 1);
+        }
+        CHECK(map.size() == 384);
+        for (int i = 0; i < 769; i++) {
+            REQUIRE(map.contains(i) == (i % 2 == 1));
+        }
+
+        map.incremental_rehash(false);
+        visited = 0;
+        for (auto& i : map) {
+            visited++;
+            CHECK(i.first == i.second);
+        }
+        CHECK(visited == 384);
+    }
+
+    SECTION("resize events") {
+        hash_map<int, int> map(16);
+        vector<resize_event> events;
+        map.on_resize([](const resize_event& e, void* events) {
+            static_cast<vector<resize_event>*>(events)->push_back(e);
+        }, &events);
+        for (int i = 0; i < 12; i++) {
+            map.insert({i, i});
+        }
+        map.erase(3);
+        CHECK(events.empty());
+
+        // Growth is reported before the element that triggered it is added.
+        for (int i = 12; events.empty(); i++) {
+            map.insert({i, i});
+        }
+        REQUIRE(events.size() == 1);
+        CHECK(events[0].old_capacity == 16);
+        CHECK(events[0].new_capacity == 32);
+        CHECK(events[0].size == map.size() - 1);
+        CHECK(events[0].tombstones <= 1);
+
+        map.rehash(128);
+        REQUIRE(events.size() == 2);
+        CHECK(events[1].old_capacity == 32);
+        CHECK(events[1].new_capacity == 128);
+
+        hash_map<int, int> copy(map);
+        copy.incremental_rehash(true);
+        for (int i = 100; i < 200; i++) {
+            copy.insert({i, i});
+        }
+        CHECK(events.size() == 3);
+        CHECK(events[2].new_capacity == 256);
+
+        map.on_resize(nullptr);
+        map.reserve(1000);
+        CHECK(events.size() == 3);
+
+        // Dropping the table in clear() or the destructor is not a resize.
+        {
+            hash_map<int, int> shrinking;
+            shrinking.min_load_factor(0.1f);
+            shrinking.on_resize([](const resize_event& e, void* events) {
+                static_cast<vector<resize_event>*>(events)->push_back(e);
+            }, &events);
+            shrinking.insert({1, 1});
+            CHECK(events.size() == 4);
+            shrinking.clear();
+            CHECK(shrinking.bucket_count() == 1);
+            shrinking.insert({2, 2});
+            CHECK(events.size() == 5);
+        }
+        CHECK(events.size() == 5);
+    }
+
+    SECTION("table statistics") {
+        hash_map<int, int> map(64);
+        for (int i = 0; i < 40; i++) {
+            map.insert({i, i});
+        }
+        auto s = map.stats();
+        CHECK(s.size == 40);
+        CHECK(s.capacity == 64);
+        CHECK(s.tombstones == 0);
+        CHECK(s.rehashes == 0);
+        size_t counted = 0;
+        for (size_t n : s.probe_lengths) {
+            counted += n;
+        }
+        CHECK(counted == 40);
+        CHECK(s.mean_hit_probes >= 1);
+        CHECK(s.expected_miss_probes >= 1);
+        CHECK(s.longest_cluster >= 1);
+        CHECK(s.longest_cluster <= 64);
+        CHECK(s.memory_bytes >= 64 * sizeof(pair<const int, int>) + 64);
+
+        // A constant hash piles every key onto one probe sequence.
+        struct constant_hash {
+            size_t operator()(int) const {
+                return 0;
+            }
+        };
+        robin_hood_hash_map<int, int, constant_hash> bad(64);
+        for (int i = 0; i < 40; i++) {
+            bad.insert({i, i});
+        }
+        auto b = bad.stats();
+        CHECK(b.probe_lengths.size() == 40);
+        CHECK(b.longest_cluster == 40);
+        CHECK(b.mean_hit_probes == Approx(20.5));
+        CHECK(b.mean_hit_probes > s.mean_hit_probes);
+
+        map.rehash(256);
+        CHECK(map.stats().rehashes == 1);
+#ifdef FEFU_HASH_MAP_COUNTERS
+        CHECK(map.stats().lookups == 40);
+        CHECK(map.stats().probes >= 40);
+#endif
+    }
+
+    SECTION("sparse iteration") {
+        hash_map<int, int> map;
+        map.reserve(10000);
+        CHECK(map.begin() == map.end());
+        for (int i = 0; i < 10000; i += 97) {
+            map.insert({i, i});
+        }
+        size_t visited = 0;
+        for (auto& i : map) {
+            CHECK(i.first % 97 == 0);
+            visited++;
+        }
+        CHECK(visited == map.size());
+
+        for (int i = 0; i < 10000; i += 97) {
+            if (i != 9991) map.erase(i);
+        }
+        REQUIRE(map.size() == 1);
+        CHECK(map.begin()->first == 9991);
+        CHECK(++map.begin() == map.end());
+        map.erase(9991);
+        CHECK(map.cbegin() == map.cend());
+    }
+
+    SECTION("tombstone purge") {
+        // Every 40 keys fill the next of nine adjacent runs of slots; the
+        // keys of a run are erased out of order while the next runs fill, so
+        // tombstones pile up instead of being reused.
+        struct clustered_hash {
+            size_t operator()(int i) const {
+                return i / 40 % 9 * 40;
+            }
+        };
+        hash_map<int, int, clustered_hash, equal_to<int>, fefu::allocator<pair<const int, int>>,
+                prime_modulo_policy> map(256);
+        REQUIRE(map.bucket_count() == 389);
+        vector<resize_event> events;
+        map.on_resize([](const resize_event& e, void* events) {
+            static_cast<vector<resize_event>*>(events)->push_back(e);
+        }, &events);
+        for (int i = 0; i < 5000; i++) {
+            map.insert({i, i});
+            if (i >= 120) {
+                int j = i - 120;
+                map.erase(j / 40 * 40 + j % 40 * 17 % 40);
+            }
+        }
+        CHECK(map.size() == 120);
+        CHECK(map.bucket_count() == 389);
+        CHECK(!events.empty());
+        for (auto& e : events) {
+            CHECK(e.old_capacity == e.new_capacity);
+            CHECK(e.tombstones > 0);
+        }
+        for (int i = 0; i < 5000; i++) {
+            REQUIRE(map.contains(i) == (i >= 4880));
+        }
+
+        // Mostly live elements still grow the table.
+        for (int i = 5000; i < 5300; i++) {
+            map.insert({i, i});
+        }
+        CHECK(map.bucket_count() == 769);
+    }
+
+    SECTION("shrinking") {
+        hash_map<int, int> map;
+        for (int i = 0; i < 10000; i++) {
+            map.insert({i, i});
+        }
+        CHECK(map.bucket_count() == 16384);
+        for (int i = 100; i < 10000; i++) {
+            map.erase(i);
+        }
+        CHECK(map.bucket_count() == 16384);
+        map.shrink_to_fit();
+        CHECK(map.bucket_count() == 256);
+        for (int i = 0; i < 100; i++) {
+            REQUIRE(map.at(i) == i);
+        }
+
+        // Shrinks on the next insert, to half the maximum load.
+        hash_map<int, int> autoShrink;
+        autoShrink.min_load_factor(0.1f);
+        CHECK(autoShrink.min_load_factor() == Approx(0.1f));
+        for (int i = 0; i < 10000; i++) {
+            autoShrink.insert({i, i});
+        }
+        for (int i = 0; i < 10000; i += 2) {
+            autoShrink.erase(i);
+        }
+        CHECK(autoShrink.bucket_count() == 16384);
+        size_t visited = 0;
+        for (auto it = autoShrink.begin(); it != autoShrink.end();) {
+            it = it->first % 8 != 1 ? autoShrink.erase(it) : ++it;
+            visited++;
+        }
+        CHECK(visited == 5000);
+        CHECK(autoShrink.size() == 1250);
+        CHECK(autoShrink.bucket_count() == 16384);
+        autoShrink.insert({-1, -1});
+        CHECK(autoShrink.bucket_count() == 4096);
+        CHECK(autoShrink.load_factor() < autoShrink.max_load_factor() / 2);
+        for (int i = 1; i < 10000; i += 8) {
+            REQUIRE(autoShrink.at(i) == i);
+        }
+
+        autoShrink.clear();
+        CHECK(autoShrink.bucket_count() == 1);
+        autoShrink.insert({1, 1});
+        CHECK(autoShrink.at(1) == 1);
+
+        // A fresh map does not shrink right after its first growth, nor
+        // below its first table.
+        hash_map<int, int> fresh;
+        fresh.min_load_factor(0.2f);
+        fresh.insert({1, 1});
+        fresh.insert({2, 2});
+        CHECK(fresh.bucket_count() == 16);
+        for (int i = 3; i < 100; i++) {
+            fresh.insert({i, i});
+        }
+        for (int i = 2; i < 100; i++) {
+            fresh.erase(i);
+        }
+        fresh.insert({0, 0});
+        CHECK(fresh.bucket_count() == 16);
+    }
+
+    SECTION("heterogeneous lookup") {
+        hash_map<string, int, string_hash, equal_to<>> names;
+        names.insert({"alpha", 1});
+        names.insert({"beta", 2});
+        CHECK(string_hash()("alpha") == string_hash()(string("alpha")));
+        CHECK(names.find("alpha")->second == 1);
+        CHECK(names.contains("beta"));
+#ifdef FEFU_HASH_MAP_STRING_VIEW
+        CHECK(names.at(string_view("alphabet", 5)) == 1);
+#endif
+        CHECK(names.count("gamma") == 0);
+        CHECK(names.at("beta") == 2);
+        CHECK_THROWS_AS(names.at("gamma"), std::out_of_range);
+        CHECK(names.bucket("alpha") == names.bucket(string("alpha")));
+        CHECK(names.erase("alpha") == 1);
+        CHECK(!names.contains(string("alpha")));
+
+        hash_map<tracked, int, tracked_id_hash, tracked_id_equal> map;
+        for (int i = 0; i < 100; i++) {
+            map.insert({tracked(i), i * 2});
+        }
+        const auto& constMap = map;
+        CHECK(constMap.at(7) == 14);
+        CHECK(map.find(99)->second == 198);
+        CHECK(map.find(100) == map.end());
+        CHECK(map.erase(7) == 1);
+        CHECK(!constMap.contains(7));
+        CHECK(map.erase(map.find(8)) != map.end());
+        CHECK(map.size() == 98);
+    }
+
+    SECTION("range erase and erase_if") {
+        // Erases the middle third of the iteration order and then every
+        // even key, checking exactly those elements went away.
+        auto check = [](auto& map, int n) {
+            for (int i = 0; i < n; i++) {
+                map.insert({i, i});
+            }
+            vector<int> order;
+            for (auto& x : map) {
+                order.push_back(x.first);
+            }
+            REQUIRE(order.size() == static_cast<size_t>(n));
+
+            auto first = map.begin();
+            advance(first, n / 3);
+            auto last = first;
+            advance(last, n / 3);
+            auto res = map.erase(first, last);
+            CHECK(map.size() == static_cast<size_t>(n - n / 3));
+            CHECK(res->first == order[2 * (n / 3)]);
+            for (int i = 0; i < n; i++) {
+                CHECK(map.contains(order[i]) == (i < n / 3 || i >= 2 * (n / 3)));
+            }
+            CHECK(map.erase(map.begin(), map.begin()) == map.begin());
+
+            // The last five, which for Robin Hood wrap around the table end.
+            auto tail = map.begin();
+            advance(tail, n - n / 3 - 5);
+            CHECK(map.erase(tail, map.cend()) == map.end());
+            for (int i = n - 5; i < n; i++) {
+                CHECK_FALSE(map.contains(order[i]));
+            }
+            size_t calls = 0;
+            auto erased = map.erase_if([&calls](pair<const int, int>& x) {
+                calls++;
+                return x.first % 2 == 0;
+            });
+            size_t left = n - n / 3 - 5;
+            CHECK(calls == left);
+            CHECK(map.size() == left - erased);
+            for (auto& x : map) {
+                CHECK(x.first % 2 == 1);
+            }
+            CHECK(map.erase(map.begin(), map.end()) == map.end());
+            CHECK(map.empty());
+        };
+
+        hash_map<int, int> groups;
+        check(groups, 60);
+        // The range runs from the table being drained into the new one.
+        hash_map<int, int> draining(1024);
+        draining.incremental_rehash(true);
+        check(draining, 769);
+
+        // One long run that wraps around the end of the table.
+        struct tail_hash {
+            size_t operator()(int) const {
+                return 90;
+            }
+        };
+        robin_hood_hash_map<int, int, tail_hash, equal_to<int>,
+                fefu::allocator<pair<const int, int>>, prime_modulo_policy> wrapping(64);
+        REQUIRE(wrapping.bucket_count() == 97);
+        check(wrapping, 60);
+    }
+
+    SECTION("in-place emplace") {
+        hash_map<int, counted> map;
+        counted::built = counted::moves = 0;
+        CHECK(map.try_emplace(1, 5).second);
+        CHECK_FALSE(map.try_emplace(1, 6).second);
+        CHECK(map.at(1).value == 5);
+        CHECK(map.emplace(2, 7).second);
+        CHECK_FALSE(map.emplace(2, 8).second);
+        CHECK(map.at(2).value == 7);
+        CHECK(map[1].value == 5);
+        CHECK(map[3].value == 0);
+        CHECK(counted::built == 3);
+        CHECK(counted::moves == 0);
+
+        // Only a miss builds the value it is given.
+        counted one(1);
+        counted::built = 0;
+        CHECK_FALSE(map.insert_or_assign(3, one).second);
+        CHECK_FALSE(map.emplace(make_pair(3, one)).second);
+        CHECK(counted::built == 1);
+        CHECK(map[3].value == 1);
+
+        // A value that fails to build leaves no trace.
+        robin_hood_hash_map<int, counted> rh;
+        for (int i = 0; i < 100; i++) {
+            rh.try_emplace(i, i);
+        }
+        for (int i = 100; i < 120; i++) {
+            CHECK_THROWS_AS(rh.try_emplace(i, -1), std::invalid_argument);
+            CHECK_THROWS_AS(map.try_emplace(i, -1), std::invalid_argument);
+        }
+        CHECK(rh.size() == 100);
+        CHECK(map.size() == 3);
+        for (int i = 0; i < 120; i++) {
+            CHECK(rh.contains(i) == (i < 100));
+            if (i < 100) CHECK(rh.at(i).value == i);
+        }
+        CHECK(static_cast<size_t>(distance(map.begin(), map.end())) == map.size());
+
+        // A value argument may be an element the insert is about to move.
+        hash_map<int, string> grown(16);
+        robin_hood_hash_map<int, string> shifted(64);
+        hash_map<int, string> drained(16);
+        drained.incremental_rehash(true);
+        for (int i = 0; i < 12; i++) {
+            grown[i] = shifted[i] = drained[i] = string(40, char('a' + i));
+        }
+        REQUIRE(grown.bucket_count() == 16);
+        CHECK(grown.insert_or_assign(100, grown.at(3)).second);
+        REQUIRE(grown.bucket_count() == 32);
+        for (int i = 12; i < 23; i++) {
+            grown[i] = to_string(i);
+        }
+        REQUIRE(grown.bucket_count() == 32);
+        CHECK(grown.emplace(101, grown.at(4)).second);
+        REQUIRE(grown.bucket_count() == 64);
+        CHECK(grown.at(100) == string(40, 'd'));
+        CHECK(grown.at(101) == string(40, 'e'));
+
+        CHECK(drained.try_emplace(100, drained.at(3)).second);
+        CHECK(drained.try_emplace(101, drained.at(5)).second);
+        CHECK(drained.at(100) == string(40, 'd'));
+        CHECK(drained.at(101) == string(40, 'f'));
+
+        for (int i = 0; i < 12; i++) {
+            CHECK(shifted.try_emplace(100 + i, shifted.at(i)).second);
+            CHECK(shifted.emplace(200 + i, shifted.at(i)).second);
+        }
+        CHECK(shifted.bucket_count() == 64);
+        for (int i = 0; i < 12; i++) {
+            REQUIRE(shifted.at(i) == string(40, char('a' + i)));
+            REQUIRE(shifted.at(100 + i) == shifted.at(i));
+            REQUIRE(shifted.at(200 + i) == shifted.at(i));
+        }
+    }
+
+    SECTION("single-probe insert") {
+        // Every key shares one probe sequence; a new key takes the first
+        // free slot on it, tombstones included.
+        struct constant_hash {
+            size_t operator()(int) const {
+                return 0;
+            }
+        };
+        hash_map<int, int, constant_hash> map(64);
+        for (int i = 0; i < 40; i++) {
+            map.insert({i, i});
+        }
+        size_t freed = map.bucket(5);
+        map.erase(5);
+        CHECK(map.stats().tombstones == 1);
+        CHECK_FALSE(map.insert({7, 0}).second);
+        CHECK(map.insert({100, 100}).second);
+        CHECK(map.bucket(100) == freed);
+        CHECK(map.stats().tombstones == 0);
+        CHECK(map.bucket_count() == 64);
+    }
+
+    SECTION("stored hashes") {
+        // Rehashing hashes no key and only keys with a matching hash are
+        // compared, whichever probing is used.
+        auto check = [](auto probing) {
+            hash_map<string, int, counting_hash, counting_equal, fefu::allocator<pair<const string, int>>,
+                    power_of_two_policy, decltype(probing), stored_hash> map(16);
+            counting_hash::calls = counting_equal::calls = 0;
+            for (int i = 0; i < 1000; i++) {
+                map.insert({"key:" + to_string(i), i});
+            }
+            CHECK(counting_hash::calls == 1000);
+            CHECK(counting_equal::calls == 0);
+            map.rehash(8192);
+            for (int i = 0; i < 1000; i += 2) {
+                map.erase("key:" + to_string(i));
+            }
+            for (int i = 0; i < 1000; i++) {
+                REQUIRE(map.contains("key:" + to_string(i)) == (i % 2 == 1));
+            }
+            CHECK(counting_hash::calls == 2500);
+            CHECK(counting_equal::calls == 1000);
+            CHECK(map.stats().memory_bytes >= map.bucket_count() * (sizeof(pair<const string, int>) + sizeof(size_t)));
+        };
+        check(group_probing());
+        check(robin_hood_probing());
+
+        stored_hash_map<int, int> ints;
+        ints.incremental_rehash(true);
+        for (int i = 0; i < 5000; i++) {
+            ints.insert({i, i});
+        }
+        for (int i = 0; i < 5000; i += 3) {
+            ints.erase(i);
+        }
+        ints.shrink_to_fit();
+        for (int i = 0; i < 5000; i++) {
+            REQUIRE(ints.contains(i) == (i % 3 != 0));
+        }
+    }
+
+    SECTION("precomputed hashes") {
+        hash_map<string, int, counting_hash> a;
+        stored_hash_map<string, int, counting_hash> b;
+        vector<pair<string, size_t>> keys;
+        for (int i = 0; i < 300; i++) {
+            string k = "key:" + to_string(i);
+            keys.emplace_back(k, a.hash_function()(k));
+        }
+
+        // One hash per key serves both maps. Growing would rehash a's keys.
+        a.reserve(keys.size());
+        b.reserve(keys.size());
+        counting_hash::calls = 0;
+        for (auto& k : keys) {
+            CHECK(a.insert({k.first, 1}, k.second).second);
+            CHECK(b.insert(make_pair(k.first, 2), k.second).second);
+            CHECK_FALSE(a.insert({k.first, 3}, k.second).second);
+            CHECK_FALSE(b.insert_or_assign(k.first, 2, k.second).second);
+        }
+        for (auto& k : keys) {
+            REQUIRE(a.find(k.first, k.second) != a.end());
+            CHECK(a.find(k.first, k.second)->second == 1);
+            CHECK(static_cast<const stored_hash_map<string, int, counting_hash>&>(b).find(k.first, k.second)->second == 2);
+            CHECK(b.contains(k.first, k.second));
+        }
+        for (size_t i = 0; i < keys.size(); i += 2) {
+            CHECK(a.erase(keys[i].first, keys[i].second) == 1);
+            CHECK(a.erase(keys[i].first, keys[i].second) == 0);
+        }
+        CHECK(counting_hash::calls == 0);
+
+        // The usual overloads agree with the hashed ones.
+        for (size_t i = 0; i < keys.size(); i++) {
+            CHECK(a.contains(keys[i].first) == (i % 2 == 1));
+        }
+
+        concurrent_hash_map<string, int, counting_hash> shards(8);
+        shards.reserve(keys.size() * 4);
+        counting_hash::calls = 0;
+        for (auto& k : keys) {
+            shards.insert({k.first, 1});
+            shards.insert_or_assign(k.first, 2);
+        }
+        for (auto& k : keys) {
+            CHECK(shards.contains(k.first));
+            CHECK(shards.erase(k.first) == 1);
+        }
+        CHECK(counting_hash::calls == 4 * keys.size());
+    }
+
+    SECTION("one block per table") {
+        hash_map<int, int, std::hash<int>, std::equal_to<int>, counting_allocator<pair<const int, int>>> plain;
+        stored_hash_map<string, int, std::hash<string>, std::equal_to<string>,
+                counting_allocator<pair<const string, int>>> stored;
+        allocation_counter::calls = 0;
+        allocation_counter::misaligned = 0;
+        plain.rehash(1000);
+        stored.rehash(1000);
+        CHECK(allocation_counter::calls == 2);
+
+        plain.incremental_rehash(true);
+        for (int i = 0; i < 5000; i++) {
+            plain.insert({i, i});
+            stored.insert({to_string(i), i});
+        }
+        CHECK(allocation_counter::calls == plain.stats().rehashes + stored.stats().rehashes);
+        CHECK(allocation_counter::misaligned == 0);
+        for (int i = 0; i < 5000; i++) {
+            REQUIRE(plain.at(i) == i);
+            REQUIRE(stored.at(to_string(i)) == i);
+        }
+
+        auto p = plain.stats();
+        CHECK(p.memory_bytes % cache_line_size == 0);
+        CHECK(p.memory_bytes >= plain.bucket_count() * (sizeof(pair<const int, int>) + 1));
+        CHECK(p.memory_bytes < plain.bucket_count() * (sizeof(pair<const int, int>) + 1) + 128);
+        CHECK(stored.stats().memory_bytes >= stored.bucket_count() * (sizeof(pair<const string, int>) + sizeof(size_t) + 1));
+    }
+
+    SECTION("empty maps") {
+        using counted_map = hash_map<int, int, std::hash<int>, std::equal_to<int>, counting_allocator<pair<const int, int>>>;
+        using counted_rh_map = robin_hood_hash_map<int, int, std::hash<int>, std::equal_to<int>,
+                counting_allocator<pair<const int, int>>, prime_modulo_policy>;
+        static_assert(std::is_nothrow_move_constructible<counted_map>::value, "");
+        allocation_counter::calls = 0;
+        vector<counted_map> many(1000);
+        counted_rh_map rh;
+        stored_hash_map<string, int, std::hash<string>, std::equal_to<string>,
+                counting_allocator<pair<const string, int>>> stored;
+        counted_map moved(std::move(many[0]));
+        counted_map copied(many[1]);
+        copied.clear();
+        swap(copied, many[2]);
+        CHECK(allocation_counter::calls == 0);
+
+        // An empty map answers every query without a table of its own.
+        CHECK(many[3].find(1) == many[3].end());
+        CHECK(many[3].begin() == many[3].end());
+        CHECK(many[3].erase(1) == 0);
+        CHECK(many[3].count(1) == 0);
+        CHECK_FALSE(rh.contains(7));
+        CHECK(stored.find("x") == stored.end());
+        CHECK(many[3].stats().memory_bytes == 0);
+        CHECK(allocation_counter::calls == 0);
+
+        many[4].max_load_factor(1);
+        many[4][5] = 6;
+        rh.insert({7, 8});
+        stored.emplace("x", 1);
+        moved.insert({1, 2});
+        CHECK(allocation_counter::calls == 4);
+        CHECK(many[4].at(5) == 6);
+        CHECK(rh.at(7) == 8);
+        CHECK(stored.at("x") == 1);
+        CHECK(moved.bucket_count() == 16);
+
+        counted_map taken(std::move(moved));
+        CHECK(taken.at(1) == 2);
+        CHECK(moved.empty());
+        CHECK(moved.find(1) == moved.end());
+        moved.insert({3, 4});
+        CHECK(moved.at(3) == 4);
+
+        // Emptied maps go back to the empty group instead of a 1-slot table.
+        allocation_counter::calls = 0;
+        counted_map fresh;
+        fresh.reserve(0);
+        fresh.rehash(0);
+        fresh.shrink_to_fit();
+        CHECK(allocation_counter::calls == 0);
+        CHECK(fresh.stats().rehashes == 0);
+        moved.min_load_factor(0.1f);
+        moved.clear();
+        CHECK(moved.stats().memory_bytes == 0);
+        CHECK(moved.bucket_count() == 1);
+        taken.erase(1);
+        taken.reserve(0);
+        CHECK(taken.stats().memory_bytes == 0);
+        copied.shrink_to_fit();
+        CHECK(copied.stats().memory_bytes == 0);
+        CHECK(allocation_counter::calls == 0);
+        moved.insert({5, 6});
+        CHECK(moved.at(5) == 6);
+        CHECK(allocation_counter::calls == 1);
+    }
+
+    SECTION("huge page allocator") {
+        using huge_alloc = huge_page_allocator<pair<const int, int>>;
+        huge_alloc alloc(huge_page_size / 2);
+        {
+            hash_map<int, int, std::hash<int>, std::equal_to<int>, huge_alloc> big(alloc);
+            big.reserve(100000);
+            CHECK(big.get_allocator() == alloc);
+            for (int i = 0; i < 100000; i++) {
+                big.insert({i, -i});
+            }
+            bool found = true;
+            for (int i = 0; i < 100000; i++) {
+                found = found && big.at(i) == -i;
+            }
+            CHECK(found);
+            size_t block = big.stats().memory_bytes;
+            CHECK(block >= huge_page_size / 2);
+            CHECK(alloc.mapped_bytes() == (block + huge_page_size - 1) / huge_page_size * huge_page_size);
+            CHECK(reinterpret_cast<std::uintptr_t>(&*big.begin()) % alignof(pair<const int, int>) == 0);
+
+            hash_map<int, int, std::hash<int>, std::equal_to<int>, huge_alloc> small(alloc);
+            small.insert({1, 1});
+            CHECK(alloc.mapped_bytes() == (block + huge_page_size - 1) / huge_page_size * huge_page_size);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            // The kernel accepts the advice whenever it was built with THP.
+            CHECK(alloc.huge_pages() == std::ifstream("/sys/kernel/mm/transparent_hugepage/enabled").good());
+#endif
+        }
+        CHECK(alloc.mapped_bytes() == 0);
+        CHECK(huge_alloc() != alloc);
+        CHECK(huge_page_allocator<char>(alloc) == alloc);
+    }
+
+    SECTION("arena allocator") {
+        using arena_map = hash_map<int, int, std::hash<int>, std::equal_to<int>,
+                arena_allocator<std::pair<const int, int>>>;
+        arena scratch(1024);
+        {
+            arena_map m{arena_allocator<std::pair<const int, int>>(scratch)};
+            for (int i = 0; i < 2000; i++) {
+                m.insert({i, i * 2});
+            }
+            for (int i = 0; i < 2000; i += 2) {
+                m.erase(i);
+            }
+            // Slots and control bytes both come from the arena.
+            CHECK(scratch.used() >= m.bucket_count() * (sizeof(std::pair<const int, int>) + 1));
+            CHECK(scratch.reserved() >= scratch.used());
+
+            arena_map copy(m);
+            CHECK(copy.get_allocator() == m.get_allocator());
+            CHECK(copy.size() == 1000);
+            for (int i = 0; i < 2000; i++) {
+                CHECK(copy.contains(i) == (i % 2 == 1));
+            }
+        }
+        scratch.release();
+        CHECK(scratch.used() == 0);
+        CHECK(scratch.reserved() == 0);
+
+        stored_hash_map<string, int, std::hash<string>, std::equal_to<string>,
+                arena_allocator<std::pair<const string, int>>> s{arena_allocator<std::pair<const string, int>>(scratch)};
+        s.incremental_rehash(true);
+        for (int i = 0; i < 500; i++) {
+            s["k" + to_string(i)] = i;
+        }
+        for (int i = 0; i < 500; i++) {
+            REQUIRE(s.at("k" + to_string(i)) == i);
+        }
+        CHECK(scratch.used() >= s.bucket_count() * (sizeof(std::pair<const string, int>) + sizeof(size_t) + 1));
+
+        arena other;
+        CHECK(arena_allocator<int>(scratch) == arena_allocator<char>(scratch));
+        CHECK(arena_allocator<int>(scratch) != arena_allocator<int>(other));
+        auto* big = arena_allocator<double>(other).allocate(10000);
+        big[9999] = 1.0;
+        CHECK(reinterpret_cast<std::uintptr_t>(big) % alignof(double) == 0);
+        CHECK(other.reserved() >= 10000 * sizeof(double));
+
+        // An oversized allocation gets an exact block and leaves the
+        // doubling sequence and the current block alone.
+        arena sized(1024);
+        sized.allocate(16, 8);
+        CHECK(sized.reserved() == 1024);
+        sized.allocate(100000, 64);
+        size_t afterBig = sized.reserved();
+        CHECK(afterBig - 1024 < 100000 + 256);
+        sized.allocate(512, 8);
+        CHECK(sized.reserved() == afterBig);
+        sized.allocate(1024, 8);
+        CHECK(sized.reserved() == afterBig + 2048);
+    }
+
+    SECTION("batched lookup") {
+        hash_map<int, int> map;
+        map.incremental_rehash(true);
+        for (int i = 0; i < 1000; i += 2) {
+            map.insert({i, -i});
+        }
+        vector<int> keys;
+        for (int i = 0; i < 1000; i += 3) {
+            keys.push_back(i);
+        }
+
+        vector<hash_map<int, int>::iterator> found;
+        map.find_many(keys.begin(), keys.end(), back_inserter(found));
+        REQUIRE(found.size() == keys.size());
+        vector<bool> present(keys.size());
+        CHECK(map.contains_many(keys.begin(), keys.end(), present.begin()) == present.end());
+        for (size_t i = 0; i < keys.size(); i++) {
+            CHECK(found[i] == map.find(keys[i]));
+            CHECK(present[i] == (keys[i] % 2 == 0));
+        }
+    }
     
-}
\ No newline at end of file
+}
+
+TEST_CASE("concurrent_hash_map") {
+    concurrent_hash_map<int, int> map(8);
+    CHECK(map.shard_count() == 8);
+
+    const int threads = 8;
+    const int perThread = 2000;
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&map, t] {
+            for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+                map.insert({i, i});
+                map.visit(i / 2, [](pair<const int, int>& x) { x.second++; });
+                map.insert_or_assign(-i - 1, i);
+                if (i % 4 == 0) map.erase(-i - 1);
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    int value = 0;
+    CHECK(map.find(threads * perThread - 1, value));
+    CHECK(!map.find(threads * perThread, value));
+    CHECK(map.size() == threads * perThread + threads * perThread * 3 / 4);
+
+    long long total = 0;
+    map.visit_all([&total](const pair<const int, int>& x) {
+        if (x.first >= 0) total += x.second - x.first;
+    });
+    // Every visit of a key that was already inserted bumped its value.
+    CHECK(total > 0);
+    CHECK(total <= threads * perThread);
+
+    map.clear();
+    CHECK(map.empty());
+}
+
+TEST_CASE("optimistic_hash_map") {
+    struct pair_value {
+        long long value;
+        long long check;
+    };
+    optimistic_hash_map<int, pair_value> map(4);
+    CHECK(map.shard_count() == 4);
+
+    const int keys = 4000;
+    atomic<bool> done(false);
+    atomic<long long> hits(0);
+    atomic<int> torn(0);
+    vector<thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&] {
+            long long found = 0;
+            while (!done.load()) {
+                for (int k = 0; k < keys; k += 7) {
+                    pair_value v{0, 0};
+                    if (map.find(k, v)) {
+                        // A torn read would break the pairing.
+                        if (v.check != -v.value) torn++;
+                        found++;
+                    }
+                }
+            }
+            hits += found;
+        });
+    }
+    vector<thread> writers;
+    for (int t = 0; t < 2; t++) {
+        writers.emplace_back([&map, t] {
+            for (int round = 0; round < 3; round++) {
+                for (int k = t; k < keys; k += 2) {
+                    long long v = k * 10 + round;
+                    map.insert_or_assign(k, pair_value{v, -v});
+                    if (k % 5 == 0) map.erase(k);
+                }
+            }
+        });
+    }
+    for (auto& w : writers) {
+        w.join();
+    }
+    done = true;
+    for (auto& r : readers) {
+        r.join();
+    }
+
+    CHECK(torn == 0);
+    CHECK(hits > 0);
+    CHECK(map.size() == keys - keys / 5);
+    pair_value v{0, 0};
+    CHECK(map.find(1, v));
+    CHECK(v.value == 12);
+    CHECK(!map.contains(5));
+    CHECK(!map.insert({1, pair_value{0, 0}}));
+    CHECK(map.insert({5, pair_value{0, 0}}));
+    map.clear();
+    CHECK(map.empty());
+
+    // A table retired while a reader pins it is freed once the reader
+    // leaves, without waiting for another write.
+    static atomic<bool> freed(false);
+    atomic<int> stage(0);
+    thread reader([&stage] {
+        epoch_reclaimer::guard pin(epoch_reclaimer::instance());
+        stage = 1;
+        while (stage != 2) this_thread::yield();
+    });
+    while (stage != 1) this_thread::yield();
+    epoch_reclaimer::instance().retire(new int(0), [](void* p) {
+        delete static_cast<int*>(p);
+        freed = true;
+    });
+    CHECK(!freed);
+    stage = 2;
+    reader.join();
+    CHECK(freed);
+}